@@ -974,6 +974,147 @@ go-demo() {
 }
 
 
+#---
+
+# env: np, hosts
+go-bench-hybrid() {
+    local args=(
+            -nsteps 512
+            -nx $((256 / 16))
+            -ny $((256 / 16))
+            -nz $((64 / 4))
+            -nxcuts 16
+            -nycuts 16
+            -nzcuts 4
+            -width 512
+            -height 512
+            -spp 16
+    )
+
+    # The -hybrid 1 rows all render the same structured bricks, so only the
+    # device and rank layout differ between them; the first row renders the
+    # unstructured volume for reference.
+    printf $'== 1 node: %d ranks, mpiDistributed, unstructured\n' "${np:=4}"
+    go src run mpirun \
+    -np "${np:?}" \
+            vtkPDistributedDataFilterExample \
+            "${args[@]}" \
+    2>&1 | grep -E '^(render|job|[0-9]+ jobs)' \
+    || die "Failed: vtkPDistributedDataFilterExample"
+
+    printf $'== 1 node: %d ranks, mpiDistributed, bricks (baseline)\n' "${np:?}"
+    go src run mpirun \
+    -np "${np:?}" \
+            vtkPDistributedDataFilterExample \
+            "${args[@]}" \
+            -hybrid 1 \
+    2>&1 | grep -E '^(render|job|[0-9]+ jobs)' \
+    || die "Failed: vtkPDistributedDataFilterExample -hybrid 1"
+
+    printf $'== 1 node: 1 rank, local device, bricks\n'
+    go src run mpirun \
+    -np 1 \
+            vtkPDistributedDataFilterExample \
+            "${args[@]}" \
+            -hybrid 1 \
+    2>&1 | grep -E '^(render|job|[0-9]+ jobs)' \
+    || die "Failed: vtkPDistributedDataFilterExample -hybrid 1"
+
+    [ -n "${hosts:-}" ] || return 0
+
+    printf $'== %s: %d ranks per node, mpiDistributed, bricks (baseline)\n' "${hosts:?}" "${np:?}"
+    go src run mpirun \
+    -hosts "${hosts:?}" \
+    -ppn "${np:?}" \
+            vtkPDistributedDataFilterExample \
+            "${args[@]}" \
+            -hybrid 1 \
+    2>&1 | grep -E '^(render|job|[0-9]+ jobs)' \
+    || die "Failed: vtkPDistributedDataFilterExample -hybrid 1"
+
+    printf $'== %s: 1 rank per node, mpiDistributed, bricks\n' "${hosts:?}"
+    go src run mpirun \
+    -hosts "${hosts:?}" \
+    -ppn 1 \
+            vtkPDistributedDataFilterExample \
+            "${args[@]}" \
+            -hybrid 1 \
+    2>&1 | grep -E '^(render|job|[0-9]+ jobs)' \
+    || die "Failed: vtkPDistributedDataFilterExample -hybrid 1"
+}
+
+# Needs a build configured with -DENABLE_MESSAGE_VALIDATION=ON, e.g.
+# src_cmake_config+=( -DENABLE_MESSAGE_VALIDATION:BOOL=ON ) in env.sh.
+# env: runs, seed
+go-validate-d3() {
+    RANDOM=${seed:=${RANDOM:?}}
+    printf $'seed %d\n' "${seed:?}"
+
+    local i np nx nxcuts nycuts nzcuts minimal failed=()
+    for ((i=0; i<${runs:=20}; ++i)); do
+        np=$((2 + RANDOM % 7))
+        nx=$((1 << (RANDOM % 4)))
+        nxcuts=$((1 + RANDOM % 8))
+        nycuts=$((1 + RANDOM % 8))
+        nzcuts=$((1 + RANDOM % 4))
+        minimal=$((RANDOM % 2))
+
+        local args=(
+                -np "${np:?}"
+                vtkPDistributedDataFilterExample
+                -d3 1
+                -d3-minimal-memory "${minimal:?}"
+                -validate 1
+                -nsteps 64
+                -nx "${nx:?}"
+                -ny "${nx:?}"
+                -nz "${nx:?}"
+                -nxcuts "${nxcuts:?}"
+                -nycuts "${nycuts:?}"
+                -nzcuts "${nzcuts:?}"
+                -width 64
+                -height 64
+        )
+
+        printf $'[%d/%d] mpirun %s\n' "$((i + 1))" "${runs:?}" "${args[*]}"
+        go src run mpirun "${args[@]}" 2>&1 | grep '^validate:'
+        if [ "${PIPESTATUS[0]}" -ne 0 ]; then
+            failed+=( "${args[*]}" )
+        fi
+    done
+
+    printf $'%d of %d runs failed\n' "${#failed[@]}" "${runs:?}"
+    [ "${#failed[@]}" -eq 0 ] || printf $'  mpirun %s\n' "${failed[@]}"
+    [ "${#failed[@]}" -eq 0 ]
+}
+
+# Compares the integer-power kernel specializations against std::pow by
+# running the same fixed exponents once exactly and once slightly off.
+go-bench-kernels() {
+    local kernel power
+    for kernel in multibrot burningship; do
+        for power in 2 2.001 8 8.001; do
+            printf $'== %s, power %s\n' "${kernel:?}" "${power:?}"
+            go src run mpirun \
+            -np 1 \
+                    vtkPDistributedDataFilterExample \
+                    -kernel "${kernel:?}" \
+                    -power "${power:?}" \
+                    -zmin -0.5 \
+                    -zmax 0.5 \
+                    -nsteps 256 \
+                    -nx 64 \
+                    -ny 64 \
+                    -nz 16 \
+                    -width 64 \
+                    -height 64 \
+            2>&1 | grep '^compute' \
+            || die "Failed: vtkPDistributedDataFilterExample"
+        done
+    done
+}
+
+
 #---
 
 go() {
@@ -3,18 +3,34 @@
  */
 
 // stdlib
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <complex>
 #include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // vtk
 #include <vtkCellData.h>
+#include <vtkCommunicator.h>
 #include <vtkDataObject.h>
 #include <vtkDoubleArray.h>
 #include <vtkFloatArray.h>
 #include <vtkHexahedron.h>
 #include <vtkInformation.h>
+#include <vtkMPI.h>
+#include <vtkMPICommunicator.h>
 #include <vtkMPIController.h>
 #include <vtkMultiProcessController.h>
 #include <vtkNew.h>
@@ -44,6 +60,19 @@
 // MPI
 #include <mpi.h>
 
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef ENABLE_PERF_COUNTERS
+// Linux
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 
 //---
 
@@ -56,44 +85,95 @@ struct Mandelbrot {
 
   enum Debug { OnlyData, OnlyNsteps };
 
+  // Multibrot and BurningShip iterate in 2D. With `power` 0 they use the z
+  // coordinate as the exponent; with a fixed `power`, z is the real part of
+  // the starting value instead, so each slice is a different cut through
+  // the Mandelbrot/Julia parameter space. Mandelbulb uses z as the third
+  // spatial dimension and takes its exponent from `power` (8 if 0).
+  enum Kernel { Multibrot = 0, BurningShip, Mandelbulb };
+
+  // z <- z^p for arbitrary real p
+  struct PowKernel {
+    ScalarF p;
+    ComplexF operator()(ComplexF z) const { return std::pow(z, p); }
+  };
+
+  // z <- z^N for integer N, as repeated complex multiplies. The multiply is
+  // spelled out to avoid the NaN/inf recovery of std::complex operator*.
+  template <int N>
+  struct IntPowKernel {
+    ComplexF operator()(ComplexF z) const {
+      ScalarF re = z.real(), im = z.imag();
+      for (int i=1; i<N; ++i) {
+        ScalarF t = re * z.real() - im * z.imag();
+        im = re * z.imag() + im * z.real();
+        re = t;
+      }
+      return ComplexF(re, im);
+    }
+  };
+
+  // z <- (|Re z| + i|Im z|)^p
+  template <typename Inner>
+  struct BurningShipKernel {
+    Inner inner;
+    ComplexF operator()(ComplexF z) const { return inner(ComplexF(std::abs(z.real()), std::abs(z.imag()))); }
+  };
+
+  static size_t ncomponents(Kernel kernel) { return kernel == Mandelbulb ? 3 : 2; }
+
+  // The summary holds the min, max and mean nsteps over each brick^3 group
+  // of cells, as three consecutive cx*cy*cz planes.
+  enum Summary { SummaryMin = 0, SummaryMax, SummaryMean };
+
   Mandelbrot() = default;
   Mandelbrot(Mandelbrot &) = delete;
   Mandelbrot(Mandelbrot &&) = default;
-  Mandelbrot(size_t nx_, size_t ny_, size_t nz_, BoundsF bounds_);
+  Mandelbrot(size_t nx_, size_t ny_, size_t nz_, BoundsF bounds_, Kernel kernel_=Multibrot, ScalarF power_=0.0f);
   Mandelbrot &operator=(Mandelbrot &) = delete;
   ~Mandelbrot() = default;
 
   void debug(Debug);
   void step(size_t dt);
-  vtkUnstructuredGrid *vtk(vtkUnstructuredGrid *unstructuredGrid=nullptr);
+  template <typename Kernel_>
+  void stepSlice(size_t zi, size_t dt, Kernel_ kernel_);
+  void stepMandelbulb(size_t dt);
+  void summarize();
+  const ScalarU *summaryPlane(Summary which) const { return summary.data() + which*cx*cy*cz; }
+  ScalarU summaryMax() const;
+  vtkUnstructuredGrid *vtk(vtkUnstructuredGrid *unstructuredGrid=nullptr, ScalarU below=0);
 
   size_t nx{0}, ny{0}, nz{0};
   BoundsF bounds{0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+  Kernel kernel{Multibrot};
+  ScalarF power{0.0f};
+  size_t niters{0};
   std::vector<ScalarF> data{};
   std::vector<ScalarU> nsteps{};
+  size_t brick{8};
+  size_t cx{0}, cy{0}, cz{0};
+  std::vector<ScalarU> summary{};
 };
 
-Mandelbrot::Mandelbrot(size_t nx_, size_t ny_, size_t nz_, Mandelbrot::BoundsF bounds_)
+Mandelbrot::Mandelbrot(size_t nx_, size_t ny_, size_t nz_, Mandelbrot::BoundsF bounds_, Mandelbrot::Kernel kernel_, Mandelbrot::ScalarF power_)
   : nx(nx_)
   , ny(ny_)
   , nz(nz_)
   , bounds(bounds_)
-  , data(2*nx_*ny_*nz_)
-  , nsteps(nx_*ny_*nz_)
+  , kernel(kernel_)
+  , power(power_)
+  , data(ncomponents(kernel_)*nx_*ny_*nz_, 0.0f)
+  , nsteps(nx_*ny_*nz_, 0)
 {
-  for (size_t zi=0; zi<nz; ++zi) {
-    size_t zindex = zi*ny*nx;
-
-    for (size_t yi=0; yi<ny; ++yi) {
-      size_t yindex = zindex + yi*nx;
-
-      for (size_t xi=0; xi<nx; ++xi) {
-        size_t xindex = yindex + xi;
+  if (kernel == Mandelbulb || power == 0.0f) {
+    return;
+  }
 
-        data[2*xindex+0] = 0.0f;
-        data[2*xindex+1] = 0.0f;
-        nsteps[xindex] = 0;
-      }
+  for (size_t zi=0; zi<nz; ++zi) {
+    ScalarF zratio = (ScalarF)zi / (ScalarF)nz;
+    ScalarF z = std::get<MinZ>(bounds) + zratio * (std::get<MaxZ>(bounds) - std::get<MinZ>(bounds));
+    for (size_t i=zi*ny*nx; i<(zi+1)*ny*nx; ++i) {
+      data[2*i+0] = z;
     }
   }
 }
@@ -118,7 +198,8 @@ void Mandelbrot::debug(Debug which) {
         size_t xindex = yindex + xi;
 
         if (which == OnlyData) {
-          std::fprintf(stderr, " %+0.2f%+0.2fi", data[2*xindex+0], data[2*xindex+1]);
+          size_t nc = ncomponents(kernel);
+          std::fprintf(stderr, " %+0.2f%+0.2fi", data[nc*xindex+0], data[nc*xindex+1]);
         } else if (which == OnlyNsteps) {
           std::fprintf(stderr, " %03d", nsteps[xindex]);
         }
@@ -131,7 +212,103 @@ void Mandelbrot::debug(Debug which) {
   }
 }
 
+// Calls visit with the cheapest kernel computing z^p: a compile-time
+// specialization for small integer exponents, std::pow otherwise.
+template <typename Visit>
+static void dispatchPower(Mandelbrot::ScalarF p, Visit visit) {
+  using ScalarF = Mandelbrot::ScalarF;
+  if (p == (ScalarF)2) visit(Mandelbrot::IntPowKernel<2>{});
+  else if (p == (ScalarF)3) visit(Mandelbrot::IntPowKernel<3>{});
+  else if (p == (ScalarF)4) visit(Mandelbrot::IntPowKernel<4>{});
+  else if (p == (ScalarF)5) visit(Mandelbrot::IntPowKernel<5>{});
+  else if (p == (ScalarF)6) visit(Mandelbrot::IntPowKernel<6>{});
+  else if (p == (ScalarF)7) visit(Mandelbrot::IntPowKernel<7>{});
+  else if (p == (ScalarF)8) visit(Mandelbrot::IntPowKernel<8>{});
+  else visit(Mandelbrot::PowKernel{p});
+}
+
 void Mandelbrot::step(size_t dt) {
+  // The kernel is chosen once per block, and the power specialization
+  // either once per block for a fixed exponent or once per z slice when the
+  // exponent is the z coordinate.
+  switch (kernel) {
+  case Multibrot:
+    if (power != 0.0f) {
+      dispatchPower(power, [&](auto pow) {
+        for (size_t zi=0; zi<nz; ++zi) {
+          stepSlice(zi, dt, pow);
+        }
+      });
+      break;
+    }
+
+    for (size_t zi=0; zi<nz; ++zi) {
+      ScalarF zratio = (ScalarF)zi / (ScalarF)nz;
+      ScalarF z = std::get<MinZ>(bounds) + zratio * (std::get<MaxZ>(bounds) - std::get<MinZ>(bounds));
+      dispatchPower(z, [&](auto pow) { stepSlice(zi, dt, pow); });
+    }
+    break;
+
+  case BurningShip:
+    if (power != 0.0f) {
+      dispatchPower(power, [&](auto pow) {
+        for (size_t zi=0; zi<nz; ++zi) {
+          stepSlice(zi, dt, BurningShipKernel<decltype(pow)>{pow});
+        }
+      });
+      break;
+    }
+
+    for (size_t zi=0; zi<nz; ++zi) {
+      ScalarF zratio = (ScalarF)zi / (ScalarF)nz;
+      ScalarF z = std::get<MinZ>(bounds) + zratio * (std::get<MaxZ>(bounds) - std::get<MinZ>(bounds));
+      dispatchPower(z, [&](auto pow) { stepSlice(zi, dt, BurningShipKernel<decltype(pow)>{pow}); });
+    }
+    break;
+
+  case Mandelbulb:
+    stepMandelbulb(dt);
+    break;
+  }
+
+  niters += dt;
+  summarize();
+}
+
+template <typename Kernel_>
+void Mandelbrot::stepSlice(size_t zi, size_t dt, Kernel_ kernel_) {
+  size_t zindex = zi*ny*nx;
+
+  for (size_t yi=0; yi<ny; ++yi) {
+    ScalarF yratio = (ScalarF)yi / (ScalarF)ny;
+    ScalarF y = std::get<MinY>(bounds) + yratio * (std::get<MaxY>(bounds) - std::get<MinY>(bounds));
+    size_t yindex = zindex + yi*nx;
+
+    for (size_t xi=0; xi<nx; ++xi) {
+      ScalarF xratio = (ScalarF)xi / (ScalarF)nx;
+      ScalarF x = std::get<MinX>(bounds) + xratio * (std::get<MaxX>(bounds) - std::get<MinX>(bounds));
+      size_t xindex = yindex + xi;
+
+      for (size_t ti=0; ti<dt; ++ti) {
+        ScalarF xd = data[2*xindex+0];
+        ScalarF yd = data[2*xindex+1];
+
+        if (xd*xd + yd*yd >= 2.0) {
+          break;
+        }
+
+        ComplexF temp = kernel_(ComplexF(xd, yd));
+        data[2*xindex+0] = temp.real() + x;
+        data[2*xindex+1] = temp.imag() + y;
+        ++nsteps[xindex];
+      }
+    }
+  }
+}
+
+void Mandelbrot::stepMandelbulb(size_t dt) {
+  ScalarF p = power == 0.0f ? 8.0f : power;
+
   for (size_t zi=0; zi<nz; ++zi) {
     ScalarF zratio = (ScalarF)zi / (ScalarF)nz;
     ScalarF z = std::get<MinZ>(bounds) + zratio * (std::get<MaxZ>(bounds) - std::get<MinZ>(bounds));
@@ -148,16 +325,23 @@ void Mandelbrot::step(size_t dt) {
         size_t xindex = yindex + xi;
 
         for (size_t ti=0; ti<dt; ++ti) {
-          ScalarF xd = data[2*xindex+0];
-          ScalarF yd = data[2*xindex+1];
+          ScalarF xd = data[3*xindex+0];
+          ScalarF yd = data[3*xindex+1];
+          ScalarF zd = data[3*xindex+2];
+          ScalarF r2 = xd*xd + yd*yd + zd*zd;
 
-          if (xd*xd + yd*yd >= 2.0) {
+          if (r2 >= 2.0) {
             break;
           }
 
-          ComplexF temp = std::pow(ComplexF(xd, yd), z);
-          data[2*xindex+0] = temp.real() + x;
-          data[2*xindex+1] = temp.imag() + y;
+          // White/Nylander spherical power
+          ScalarF r = std::sqrt(r2);
+          ScalarF theta = p * std::atan2(std::sqrt(xd*xd + yd*yd), zd);
+          ScalarF phi = p * std::atan2(yd, xd);
+          ScalarF rn = std::pow(r, p);
+          data[3*xindex+0] = rn * std::sin(theta) * std::cos(phi) + x;
+          data[3*xindex+1] = rn * std::sin(theta) * std::sin(phi) + y;
+          data[3*xindex+2] = rn * std::cos(theta) + z;
           ++nsteps[xindex];
         }
       }
@@ -165,7 +349,53 @@ void Mandelbrot::step(size_t dt) {
   }
 }
 
-vtkUnstructuredGrid *Mandelbrot::vtk(vtkUnstructuredGrid *unstructuredGrid) {
+void Mandelbrot::summarize() {
+  cx = (nx + brick - 1) / brick;
+  cy = (ny + brick - 1) / brick;
+  cz = (nz + brick - 1) / brick;
+  size_t nc = cx*cy*cz;
+
+  summary.assign(3*nc, 0);
+  ScalarU *min = summary.data() + SummaryMin*nc;
+  ScalarU *max = summary.data() + SummaryMax*nc;
+  ScalarU *mean = summary.data() + SummaryMean*nc;
+  std::fill(min, min + nc, std::numeric_limits<ScalarU>::max());
+
+  std::vector<uint64_t> sums(nc, 0);
+  std::vector<uint64_t> counts(nc, 0);
+  for (size_t zi=0; zi<nz; ++zi) {
+    size_t zindex = zi*ny*nx;
+    size_t czindex = (zi/brick)*cy*cx;
+
+    for (size_t yi=0; yi<ny; ++yi) {
+      size_t yindex = zindex + yi*nx;
+      size_t cyindex = czindex + (yi/brick)*cx;
+
+      for (size_t xi=0; xi<nx; ++xi) {
+        size_t xindex = yindex + xi;
+        size_t cxindex = cyindex + xi/brick;
+
+        min[cxindex] = std::min(min[cxindex], nsteps[xindex]);
+        max[cxindex] = std::max(max[cxindex], nsteps[xindex]);
+        sums[cxindex] += nsteps[xindex];
+        ++counts[cxindex];
+      }
+    }
+  }
+
+  for (size_t i=0; i<nc; ++i) {
+    mean[i] = (ScalarU)(sums[i] / counts[i]);
+  }
+}
+
+Mandelbrot::ScalarU Mandelbrot::summaryMax() const {
+  const ScalarU *max = summaryPlane(SummaryMax);
+  return cx*cy*cz == 0 ? 0 : *std::max_element(max, max + cx*cy*cz);
+}
+
+// Cells whose brick has a maximum below `below` are left out entirely; with
+// the transfer function starting at `below` they would be transparent.
+vtkUnstructuredGrid *Mandelbrot::vtk(vtkUnstructuredGrid *unstructuredGrid, ScalarU below) {
   using Points = vtkPoints;
   using Array = vtkUnsignedShortArray;
 
@@ -194,6 +424,12 @@ vtkUnstructuredGrid *Mandelbrot::vtk(vtkUnstructuredGrid *unstructuredGrid) {
   using Cell = vtkHexahedron;
   vtkNew<Cell> cell;
 
+  if (below > 0 && summaryMax() < below) {
+    return unstructuredGrid;
+  }
+
+  const ScalarU *max = summaryPlane(SummaryMax);
+
   for (size_t i=0, zi=0; zi<nz; ++zi) {
     ScalarF z0ratio = (ScalarF)(zi + 0) / (ScalarF)nz;
     ScalarF z0 = std::get<MinZ>(bounds) + z0ratio * (std::get<MaxZ>(bounds) - std::get<MinZ>(bounds));
@@ -218,6 +454,10 @@ vtkUnstructuredGrid *Mandelbrot::vtk(vtkUnstructuredGrid *unstructuredGrid) {
         size_t xindex = yindex + xi;
         assert(("the later code expects x0 < x1, so sanity check here", x0 < x1));
 
+        if (below > 0 && max[((zi/brick)*cy + yi/brick)*cx + xi/brick] < below) {
+          continue;
+        }
+
         cell->GetPointIds()->SetId(0, points->InsertNextPoint(x0, y0, z0));
         cell->GetPointIds()->SetId(1, points->InsertNextPoint(x1, y0, z0));
         cell->GetPointIds()->SetId(2, points->InsertNextPoint(x1, y1, z0));
@@ -238,6 +478,924 @@ vtkUnstructuredGrid *Mandelbrot::vtk(vtkUnstructuredGrid *unstructuredGrid) {
 }
 
 
+//---
+
+// Blocks are fully determined by their resolution, bounds, kernel and
+// power, so they are cached under a hash of those and can be resumed from
+// their stored state when a later run asks for more iterations. Entries
+// live in memory up to `capacity` bytes; least recently used ones are
+// spilled to `directory` (if set), which is also where everything left is
+// flushed at the end.
+struct BlockCache {
+  using Key = uint64_t;
+
+  struct Entry {
+    size_t nx{0}, ny{0}, nz{0};
+    Mandelbrot::BoundsF bounds{0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    Mandelbrot::Kernel kernel{Mandelbrot::Multibrot};
+    Mandelbrot::ScalarF power{0.0f};
+    size_t niters{0};
+    double seconds{0.0};
+    std::vector<Mandelbrot::ScalarF> data{};
+    std::vector<Mandelbrot::ScalarU> nsteps{};
+    bool dirty{false};  // not yet in `directory` in this state
+
+    size_t bytes() const { return data.size() * sizeof(data[0]) + nsteps.size() * sizeof(nsteps[0]); }
+    bool matches(const Mandelbrot &) const;
+  };
+
+  BlockCache() = default;
+  BlockCache(std::string directory_, size_t capacity_);
+  BlockCache(BlockCache &) = delete;
+  BlockCache &operator=(BlockCache &) = delete;
+  ~BlockCache() = default;
+
+  static Key key(const Mandelbrot &);
+  bool load(Mandelbrot &, size_t niters, double &seconds);
+  void store(const Mandelbrot &, double seconds);
+  void flush();
+
+  std::string path(Key) const;
+  bool read(Key, const Mandelbrot &, Entry &) const;
+  bool write(Key, const Entry &) const;
+  Entry *find(Key, const Mandelbrot &);
+  void insert(Key, Entry &&);
+  void evict();
+
+  std::string directory{};
+  size_t capacity{0};
+  size_t size{0};
+  std::list<std::pair<Key, Entry>> entries{};
+  std::unordered_map<Key, std::list<std::pair<Key, Entry>>::iterator> index{};
+
+  size_t hits{0};
+  size_t resumes{0};
+  size_t misses{0};
+  double saved{0.0};
+};
+
+BlockCache::BlockCache(std::string directory_, size_t capacity_)
+  : directory(directory_)
+  , capacity(capacity_)
+{
+  if (!directory.empty() && mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "mkdir('%s') failed: %d\n", directory.c_str(), errno);
+    directory.clear();
+  }
+}
+
+// The key is only a hash, so whatever it finds, in memory or on disk, is
+// checked against the block's actual parameters before it is used.
+bool BlockCache::Entry::matches(const Mandelbrot &mandelbrot) const {
+  return nx == mandelbrot.nx
+      && ny == mandelbrot.ny
+      && nz == mandelbrot.nz
+      && kernel == mandelbrot.kernel
+      && bounds == mandelbrot.bounds
+      && power == mandelbrot.power;
+}
+
+BlockCache::Key BlockCache::key(const Mandelbrot &mandelbrot) {
+  // FNV-1a over the parameters that determine a block's contents
+  Key hash = 14695981039346656037ull;
+  auto mix = [&](const void *p, size_t n) {
+    for (size_t i=0; i<n; ++i) {
+      hash ^= static_cast<const unsigned char *>(p)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+
+  uint64_t dims[4] = { mandelbrot.nx, mandelbrot.ny, mandelbrot.nz, (uint64_t)mandelbrot.kernel };
+  mix(dims, sizeof(dims));
+  mix(mandelbrot.bounds.data(), sizeof(mandelbrot.bounds));
+  mix(&mandelbrot.power, sizeof(mandelbrot.power));
+
+  return hash;
+}
+
+std::string BlockCache::path(Key key_) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.block", (unsigned long long)key_);
+  return directory + "/" + name;
+}
+
+bool BlockCache::read(Key key_, const Mandelbrot &mandelbrot, Entry &entry) const {
+  FILE *file = fopen(path(key_).c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  uint64_t header[5];
+  bool ok = fread(header, sizeof(header), 1, file) == 1
+         && fread(entry.bounds.data(), sizeof(entry.bounds), 1, file) == 1
+         && fread(&entry.power, sizeof(entry.power), 1, file) == 1
+         && fread(&entry.seconds, sizeof(entry.seconds), 1, file) == 1;
+
+  if (ok) {
+    entry.nx = header[0];
+    entry.ny = header[1];
+    entry.nz = header[2];
+    entry.niters = header[3];
+    entry.kernel = (Mandelbrot::Kernel)header[4];
+    ok = entry.matches(mandelbrot);
+  }
+
+  if (ok) {
+    entry.data.resize(mandelbrot.data.size());
+    entry.nsteps.resize(mandelbrot.nsteps.size());
+    ok = fread(entry.data.data(), sizeof(entry.data[0]), entry.data.size(), file) == entry.data.size()
+      && fread(entry.nsteps.data(), sizeof(entry.nsteps[0]), entry.nsteps.size(), file) == entry.nsteps.size();
+  }
+
+  fclose(file);
+  return ok;
+}
+
+// Returns whether the block made it to disk; a failed write leaves no file
+// behind, neither the temporary one nor a truncated block.
+bool BlockCache::write(Key key_, const Entry &entry) const {
+  // Write under a temporary name and rename, so that ranks sharing the
+  // directory never observe a partially written block.
+  std::string filename = path(key_);
+  std::string tempname = filename + ".tmp." + std::to_string(getpid());
+
+  FILE *file = fopen(tempname.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "fopen('%s', 'wb') failed: %d\n", tempname.c_str(), errno);
+    return false;
+  }
+
+  uint64_t header[5] = { entry.nx, entry.ny, entry.nz, entry.niters, (uint64_t)entry.kernel };
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1
+         && fwrite(entry.bounds.data(), sizeof(entry.bounds), 1, file) == 1
+         && fwrite(&entry.power, sizeof(entry.power), 1, file) == 1
+         && fwrite(&entry.seconds, sizeof(entry.seconds), 1, file) == 1
+         && fwrite(entry.data.data(), sizeof(entry.data[0]), entry.data.size(), file) == entry.data.size()
+         && fwrite(entry.nsteps.data(), sizeof(entry.nsteps[0]), entry.nsteps.size(), file) == entry.nsteps.size();
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok || std::rename(tempname.c_str(), filename.c_str()) != 0) {
+    fprintf(stderr, "writing '%s' failed: %d\n", filename.c_str(), errno);
+    unlink(tempname.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+BlockCache::Entry *BlockCache::find(Key key_, const Mandelbrot &mandelbrot) {
+  auto it = index.find(key_);
+  if (it != index.end()) {
+    if (!it->second->second.matches(mandelbrot)) {
+      return nullptr;
+    }
+
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->second;
+  }
+
+  Entry entry;
+  if (directory.empty() || !read(key_, mandelbrot, entry)) {
+    return nullptr;
+  }
+
+  insert(key_, std::move(entry));
+  it = index.find(key_);
+  return it == index.end() ? nullptr : &it->second->second;
+}
+
+void BlockCache::insert(Key key_, Entry &&entry) {
+  auto it = index.find(key_);
+  if (it != index.end()) {
+    size -= it->second->second.bytes();
+    entries.erase(it->second);
+    index.erase(it);
+  }
+
+  size += entry.bytes();
+  entries.emplace_front(key_, std::move(entry));
+  index[key_] = entries.begin();
+  evict();
+}
+
+void BlockCache::evict() {
+  // The most recently used entry always stays, even if it alone is larger
+  // than the capacity.
+  while (size > capacity && entries.size() > 1) {
+    auto &[key_, entry] = entries.back();
+    if (!directory.empty() && entry.dirty) {
+      write(key_, entry);
+    }
+
+    size -= entry.bytes();
+    index.erase(key_);
+    entries.pop_back();
+  }
+}
+
+void BlockCache::flush() {
+  if (directory.empty()) {
+    return;
+  }
+
+  for (auto &[key_, entry] : entries) {
+    if (entry.dirty && write(key_, entry)) {
+      entry.dirty = false;
+    }
+  }
+}
+
+bool BlockCache::load(Mandelbrot &mandelbrot, size_t niters, double &seconds) {
+  Entry *entry = find(key(mandelbrot), mandelbrot);
+  if (entry == nullptr) {
+    ++misses;
+    return false;
+  }
+
+  mandelbrot.data = entry->data;
+  mandelbrot.nsteps = entry->nsteps;
+  mandelbrot.niters = entry->niters;
+  seconds = entry->seconds;
+
+  if (entry->niters < niters) {
+    saved += entry->seconds;
+    ++resumes;
+
+  } else {
+    // Only the part of the stored computation that was asked for counts
+    // as saved, estimated as proportional to the iterations.
+    saved += entry->niters == 0 ? 0.0 : entry->seconds * niters / entry->niters;
+
+    // A block iterated further than asked for has the same escape counts,
+    // capped at the requested number of iterations. Its data holds the
+    // later state, which is fine as long as it is not stored back.
+    for (auto &n : mandelbrot.nsteps) {
+      n = std::min<size_t>(n, niters);
+    }
+    mandelbrot.niters = niters;
+    ++hits;
+  }
+
+  return true;
+}
+
+void BlockCache::store(const Mandelbrot &mandelbrot, double seconds) {
+  Key key_ = key(mandelbrot);
+
+  auto it = index.find(key_);
+  if (it != index.end() && it->second->second.matches(mandelbrot) && it->second->second.niters >= mandelbrot.niters) {
+    return;
+  }
+
+  Entry entry;
+  entry.nx = mandelbrot.nx;
+  entry.ny = mandelbrot.ny;
+  entry.nz = mandelbrot.nz;
+  entry.bounds = mandelbrot.bounds;
+  entry.kernel = mandelbrot.kernel;
+  entry.power = mandelbrot.power;
+  entry.niters = mandelbrot.niters;
+  entry.seconds = seconds;
+  entry.data = mandelbrot.data;
+  entry.nsteps = mandelbrot.nsteps;
+  entry.dirty = true;
+  insert(key_, std::move(entry));
+}
+
+
+//---
+
+// Records the size of every point-to-point message on one communicator
+// per peer and tag while enabled, by intercepting the MPI calls through the
+// profiling interface. Receives are matched with MPI_Mprobe first, so a
+// message larger than its receive buffer is reported (with both sizes)
+// before MPI aborts on it; nonblocking receives are accounted for when
+// their request completes through any of the wait and test calls, and
+// cancelled ones are dropped. Only compiled in with
+// -DENABLE_MESSAGE_VALIDATION=ON, since the wrappers also sit in front of
+// every other MPI call the process makes, OSPRay's included.
+#ifdef ENABLE_MESSAGE_VALIDATION
+struct MessageLog {
+  struct Totals {
+    int64_t bytes{0};
+    int64_t messages{0};
+  };
+
+  struct Pending {
+    int64_t posted{0};
+    bool cancelled{false};
+  };
+
+  // per peer, by tag
+  using Log = std::vector<std::map<int, Totals>>;
+
+  MessageLog() = default;
+  MessageLog(MessageLog &) = delete;
+  MessageLog &operator=(MessageLog &) = delete;
+  ~MessageLog() = default;
+
+  void enable(MPI_Comm comm_);
+  void disable();
+  bool active(MPI_Comm comm_) const { return enabled.load(std::memory_order_relaxed) && comm_ == comm; }
+  bool active() const { return enabled.load(std::memory_order_relaxed); }
+  size_t check();
+
+  void send(int count, MPI_Datatype datatype, int dest, int tag);
+  void recv(const MPI_Status &status, int64_t posted);
+  void post(MPI_Request request, int count, MPI_Datatype datatype);
+  void complete(MPI_Request request, const MPI_Status &status);
+  void cancel(MPI_Request request);
+  void release(MPI_Request request);
+
+  std::atomic<bool> enabled{false};
+  MPI_Comm comm{MPI_COMM_NULL};
+  int rank{0};
+  std::mutex mutex{};
+  Log sent{};
+  Log received{};
+  std::unordered_map<MPI_Request, Pending> pending{};
+  size_t truncated{0};
+  size_t freed{0};
+};
+
+static MessageLog messageLog;
+
+static int64_t messageBytes(int count, MPI_Datatype datatype) {
+  int size;
+  PMPI_Type_size(datatype, &size);
+  return (int64_t)count * size;
+}
+
+void MessageLog::enable(MPI_Comm comm_) {
+  int size;
+  PMPI_Comm_size(comm_, &size);
+  PMPI_Comm_rank(comm_, &rank);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  comm = comm_;
+  sent.assign(size, {});
+  received.assign(size, {});
+  pending.clear();
+  truncated = 0;
+  freed = 0;
+  enabled = true;
+}
+
+void MessageLog::disable() {
+  enabled = false;
+}
+
+void MessageLog::send(int count, MPI_Datatype datatype, int dest, int tag) {
+  if (dest < 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Totals &totals = sent[dest][tag];
+  totals.bytes += messageBytes(count, datatype);
+  ++totals.messages;
+}
+
+void MessageLog::recv(const MPI_Status &status, int64_t posted) {
+  if (status.MPI_SOURCE < 0) {
+    return;
+  }
+
+  int bytes;
+  PMPI_Get_count(&status, MPI_BYTE, &bytes);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Totals &totals = received[status.MPI_SOURCE][status.MPI_TAG];
+  totals.bytes += bytes;
+  ++totals.messages;
+
+  if (bytes > posted) {
+    fprintf(stderr, "validate: rank %d: message from rank %d with tag %d is %d bytes, but the receive buffer holds %lld\n",
+            rank, status.MPI_SOURCE, status.MPI_TAG, bytes, (long long)posted);
+    ++truncated;
+  }
+}
+
+void MessageLog::post(MPI_Request request, int count, MPI_Datatype datatype) {
+  std::lock_guard<std::mutex> lock(mutex);
+  pending[request] = Pending{messageBytes(count, datatype), false};
+}
+
+void MessageLog::complete(MPI_Request request, const MPI_Status &status) {
+  int64_t posted;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(request);
+    if (it == pending.end()) {
+      return;
+    }
+
+    posted = it->second.posted;
+    pending.erase(it);
+  }
+
+  int cancelled;
+  PMPI_Test_cancelled(&status, &cancelled);
+  if (!cancelled) {
+    recv(status, posted);
+  }
+}
+
+void MessageLog::cancel(MPI_Request request) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(request);
+  if (it != pending.end()) {
+    it->second.cancelled = true;
+  }
+}
+
+// A receive request freed before it completed can't be accounted for, so
+// unless it was cancelled it is dropped and counted as a problem of its own.
+void MessageLog::release(MPI_Request request) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(request);
+  if (it == pending.end()) {
+    return;
+  }
+
+  if (!it->second.cancelled) {
+    fprintf(stderr, "validate: rank %d: receive request freed before it completed\n", rank);
+    ++freed;
+  }
+  pending.erase(it);
+}
+
+// Exchanges the per-peer, per-tag send totals so that every rank can
+// compare what its peers say they sent it with what it actually received.
+// Returns the number of problems found on this rank; collective over the
+// communicator.
+size_t MessageLog::check() {
+  disable();
+
+  int size = (int)sent.size();
+  std::vector<int> sentCounts(size);
+  std::vector<int> sentDispls(size);
+  std::vector<int64_t> sentLocal;
+  for (int i=0; i<size; ++i) {
+    sentDispls[i] = (int)sentLocal.size();
+    for (const auto &[tag, totals] : sent[i]) {
+      sentLocal.insert(sentLocal.end(), { (int64_t)tag, totals.bytes, totals.messages });
+    }
+    sentCounts[i] = (int)sentLocal.size() - sentDispls[i];
+  }
+
+  std::vector<int> remoteCounts(size);
+  std::vector<int> remoteDispls(size);
+  PMPI_Alltoall(sentCounts.data(), 1, MPI_INT, remoteCounts.data(), 1, MPI_INT, comm);
+  for (int i=1; i<size; ++i) {
+    remoteDispls[i] = remoteDispls[i-1] + remoteCounts[i-1];
+  }
+
+  std::vector<int64_t> sentRemote(size > 0 ? remoteDispls[size-1] + remoteCounts[size-1] : 0);
+  PMPI_Alltoallv(sentLocal.data(), sentCounts.data(), sentDispls.data(), MPI_INT64_T,
+                 sentRemote.data(), remoteCounts.data(), remoteDispls.data(), MPI_INT64_T, comm);
+
+  size_t problems = truncated + freed;
+  for (int i=0; i<size; ++i) {
+    std::map<int, Totals> remote;
+    for (int j=remoteDispls[i]; j<remoteDispls[i]+remoteCounts[i]; j+=3) {
+      remote[(int)sentRemote[j+0]] = Totals{sentRemote[j+1], sentRemote[j+2]};
+    }
+
+    std::map<int, std::pair<Totals, Totals>> tags;
+    for (const auto &[tag, totals] : remote) {
+      tags[tag].first = totals;
+    }
+    for (const auto &[tag, totals] : received[i]) {
+      tags[tag].second = totals;
+    }
+
+    for (const auto &[tag, totals] : tags) {
+      const auto &[theirs, ours] = totals;
+      if (theirs.bytes != ours.bytes || theirs.messages != ours.messages) {
+        fprintf(stderr, "validate: rank %d: rank %d sent %lld bytes in %lld messages with tag %d, but %lld bytes in %lld messages were received\n",
+                rank, i, (long long)theirs.bytes, (long long)theirs.messages, tag,
+                (long long)ours.bytes, (long long)ours.messages);
+        ++problems;
+      }
+    }
+  }
+
+  if (!pending.empty()) {
+    fprintf(stderr, "validate: rank %d: %zu receives still pending\n", rank, pending.size());
+    problems += pending.size();
+  }
+
+  return problems;
+}
+
+extern "C" {
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm) {
+  if (messageLog.active(comm)) {
+    messageLog.send(count, datatype, dest, tag);
+  }
+  return PMPI_Send(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Ssend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm) {
+  if (messageLog.active(comm)) {
+    messageLog.send(count, datatype, dest, tag);
+  }
+  return PMPI_Ssend(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request *request) {
+  if (messageLog.active(comm)) {
+    messageLog.send(count, datatype, dest, tag);
+  }
+  return PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status) {
+  if (!messageLog.active(comm)) {
+    return PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+  }
+
+  // Receive exactly the probed message, even for wildcard source or tag
+  // and with other threads receiving on the same communicator.
+  MPI_Message message;
+  MPI_Status probed;
+  PMPI_Mprobe(source, tag, comm, &message, &probed);
+  messageLog.recv(probed, messageBytes(count, datatype));
+  return PMPI_Mrecv(buf, count, datatype, &message, status);
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request *request) {
+  int result = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+  if (result == MPI_SUCCESS && messageLog.active(comm)) {
+    messageLog.post(*request, count, datatype);
+  }
+  return result;
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status) {
+  if (!messageLog.active()) {
+    return PMPI_Wait(request, status);
+  }
+
+  MPI_Request request_ = *request;
+  MPI_Status status_;
+  int result = PMPI_Wait(request, status == MPI_STATUS_IGNORE ? &status_ : status);
+  if (result == MPI_SUCCESS) {
+    messageLog.complete(request_, status == MPI_STATUS_IGNORE ? status_ : *status);
+  }
+  return result;
+}
+
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status) {
+  if (!messageLog.active()) {
+    return PMPI_Test(request, flag, status);
+  }
+
+  MPI_Request request_ = *request;
+  MPI_Status status_;
+  int result = PMPI_Test(request, flag, status == MPI_STATUS_IGNORE ? &status_ : status);
+  if (result == MPI_SUCCESS && *flag) {
+    messageLog.complete(request_, status == MPI_STATUS_IGNORE ? status_ : *status);
+  }
+  return result;
+}
+
+int MPI_Waitany(int count, MPI_Request requests[], int *index, MPI_Status *status) {
+  if (!messageLog.active()) {
+    return PMPI_Waitany(count, requests, index, status);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + count);
+  MPI_Status status_;
+  int result = PMPI_Waitany(count, requests, index, status == MPI_STATUS_IGNORE ? &status_ : status);
+  if (result == MPI_SUCCESS && *index != MPI_UNDEFINED) {
+    messageLog.complete(requests_[*index], status == MPI_STATUS_IGNORE ? status_ : *status);
+  }
+  return result;
+}
+
+int MPI_Testany(int count, MPI_Request requests[], int *index, int *flag, MPI_Status *status) {
+  if (!messageLog.active()) {
+    return PMPI_Testany(count, requests, index, flag, status);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + count);
+  MPI_Status status_;
+  int result = PMPI_Testany(count, requests, index, flag, status == MPI_STATUS_IGNORE ? &status_ : status);
+  if (result == MPI_SUCCESS && *flag && *index != MPI_UNDEFINED) {
+    messageLog.complete(requests_[*index], status == MPI_STATUS_IGNORE ? status_ : *status);
+  }
+  return result;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[]) {
+  if (!messageLog.active()) {
+    return PMPI_Waitall(count, requests, statuses);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + count);
+  std::vector<MPI_Status> statuses_(count);
+  int result = PMPI_Waitall(count, requests, statuses == MPI_STATUSES_IGNORE ? statuses_.data() : statuses);
+  if (result == MPI_SUCCESS) {
+    for (int i=0; i<count; ++i) {
+      messageLog.complete(requests_[i], statuses == MPI_STATUSES_IGNORE ? statuses_[i] : statuses[i]);
+    }
+  }
+  return result;
+}
+
+int MPI_Testall(int count, MPI_Request requests[], int *flag, MPI_Status statuses[]) {
+  if (!messageLog.active()) {
+    return PMPI_Testall(count, requests, flag, statuses);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + count);
+  std::vector<MPI_Status> statuses_(count);
+  int result = PMPI_Testall(count, requests, flag, statuses == MPI_STATUSES_IGNORE ? statuses_.data() : statuses);
+  if (result == MPI_SUCCESS && *flag) {
+    for (int i=0; i<count; ++i) {
+      messageLog.complete(requests_[i], statuses == MPI_STATUSES_IGNORE ? statuses_[i] : statuses[i]);
+    }
+  }
+  return result;
+}
+
+int MPI_Waitsome(int incount, MPI_Request requests[], int *outcount, int indices[], MPI_Status statuses[]) {
+  if (!messageLog.active()) {
+    return PMPI_Waitsome(incount, requests, outcount, indices, statuses);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + incount);
+  std::vector<MPI_Status> statuses_(incount);
+  int result = PMPI_Waitsome(incount, requests, outcount, indices, statuses == MPI_STATUSES_IGNORE ? statuses_.data() : statuses);
+  if (result == MPI_SUCCESS && *outcount != MPI_UNDEFINED) {
+    for (int i=0; i<*outcount; ++i) {
+      messageLog.complete(requests_[indices[i]], statuses == MPI_STATUSES_IGNORE ? statuses_[i] : statuses[i]);
+    }
+  }
+  return result;
+}
+
+int MPI_Testsome(int incount, MPI_Request requests[], int *outcount, int indices[], MPI_Status statuses[]) {
+  if (!messageLog.active()) {
+    return PMPI_Testsome(incount, requests, outcount, indices, statuses);
+  }
+
+  std::vector<MPI_Request> requests_(requests, requests + incount);
+  std::vector<MPI_Status> statuses_(incount);
+  int result = PMPI_Testsome(incount, requests, outcount, indices, statuses == MPI_STATUSES_IGNORE ? statuses_.data() : statuses);
+  if (result == MPI_SUCCESS && *outcount != MPI_UNDEFINED) {
+    for (int i=0; i<*outcount; ++i) {
+      messageLog.complete(requests_[indices[i]], statuses == MPI_STATUSES_IGNORE ? statuses_[i] : statuses[i]);
+    }
+  }
+  return result;
+}
+
+// A cancelled receive still completes through one of the calls above, which
+// drop it if the cancel succeeded; it is only marked here so that freeing it
+// instead is not reported.
+int MPI_Cancel(MPI_Request *request) {
+  if (messageLog.active()) {
+    messageLog.cancel(*request);
+  }
+  return PMPI_Cancel(request);
+}
+
+int MPI_Request_free(MPI_Request *request) {
+  if (messageLog.active()) {
+    messageLog.release(*request);
+  }
+  return PMPI_Request_free(request);
+}
+
+} // extern "C"
+#endif
+
+
+//---
+
+// Hardware counters (cycles, instructions, cache and branch misses) read
+// with perf_event_open(2) around each phase, and around every block for
+// the per-block phases. Step, vtk and d3 are counted for the calling thread
+// only, as one group. The main thread just waits in ospWait while
+// rendering, so render uses a second set opened with `inherit`, which also
+// covers every thread started after open(), OSPRay's workers included (and
+// their idle spinning). Not every kernel allows group reads of inherited
+// counters, so those are read one at a time. Only compiled in with
+// -DENABLE_PERF_COUNTERS=ON; otherwise the PERF_* macros expand to nothing.
+#ifdef ENABLE_PERF_COUNTERS
+struct PerfCounters {
+  enum Event { Cycles = 0, Instructions, CacheMisses, BranchMisses, NumEvents };
+  enum Phase { Step = 0, Vtk, D3, Render, NumPhases };
+
+  using Sample = std::array<uint64_t, NumEvents>;
+
+  PerfCounters() = default;
+  PerfCounters(PerfCounters &) = delete;
+  PerfCounters &operator=(PerfCounters &) = delete;
+  ~PerfCounters();
+
+  void open();
+  Sample read(Phase) const;
+  void add(Phase, const Sample &begin);
+  void report(vtkMultiProcessController *);
+
+  static const char *name(Phase);
+
+  std::array<int, NumEvents> fds{-1, -1, -1, -1};
+  std::array<int, NumEvents> inheritedFds{-1, -1, -1, -1};
+  std::array<Sample, NumPhases> totals{};
+  std::array<uint64_t, NumPhases> intervals{};
+  std::array<double, NumPhases> minIpc{};
+  std::array<double, NumPhases> maxIpc{};
+};
+
+static PerfCounters perfCounters;
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  for (int fd : inheritedFds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+void PerfCounters::open() {
+  minIpc.fill(std::numeric_limits<double>::max());
+  maxIpc.fill(0.0);
+
+  static const uint64_t configs[NumEvents] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+  };
+
+  for (size_t i=0; i<NumEvents; ++i) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.disabled = (i == 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+    if (fds[i] < 0) {
+      fprintf(stderr, "perf_event_open(%zu) failed: %d\n", i, errno);
+      break;
+    }
+  }
+
+  if (fds[NumEvents - 1] >= 0) {
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  // Has to happen before OSPRay starts its threads, or they aren't counted.
+  for (size_t i=0; i<NumEvents; ++i) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    inheritedFds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (inheritedFds[i] < 0) {
+      fprintf(stderr, "perf_event_open(%zu, inherit) failed: %d\n", i, errno);
+      break;
+    }
+  }
+}
+
+PerfCounters::Sample PerfCounters::read(Phase phase) const {
+  Sample sample{};
+  if (phase == Render) {
+    if (inheritedFds[NumEvents - 1] < 0) {
+      return sample;
+    }
+
+    for (size_t i=0; i<NumEvents; ++i) {
+      uint64_t value;
+      if (::read(inheritedFds[i], &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+        sample[i] = value;
+      }
+    }
+    return sample;
+  }
+
+  if (fds[NumEvents - 1] < 0) {
+    return sample;
+  }
+
+  uint64_t buffer[1 + NumEvents];
+  if (::read(fds[0], buffer, sizeof(buffer)) == (ssize_t)sizeof(buffer)) {
+    std::copy(buffer + 1, buffer + 1 + NumEvents, sample.begin());
+  }
+  return sample;
+}
+
+void PerfCounters::add(Phase phase, const Sample &begin) {
+  Sample end = read(phase);
+  for (size_t i=0; i<NumEvents; ++i) {
+    totals[phase][i] += end[i] - begin[i];
+  }
+
+  if (end[Cycles] > begin[Cycles]) {
+    double ipc = (double)(end[Instructions] - begin[Instructions]) / (double)(end[Cycles] - begin[Cycles]);
+    minIpc[phase] = std::min(minIpc[phase], ipc);
+    maxIpc[phase] = std::max(maxIpc[phase], ipc);
+  }
+  ++intervals[phase];
+}
+
+const char *PerfCounters::name(Phase phase) {
+  switch (phase) {
+  case Step: return "step";
+  case Vtk: return "vtk";
+  case D3: return "d3";
+  case Render: return "render (all threads)";
+  default: return "?";
+  }
+}
+
+// Sums the counts over all ranks (and takes the extremes of the interval
+// IPCs) and prints one line per phase on rank 0, followed by the ranks
+// with the fewest and most cycles and the lowest and highest IPC, which is
+// where imbalance shows; collective.
+void PerfCounters::report(vtkMultiProcessController *controller) {
+  int nranks = controller->GetNumberOfProcesses();
+  std::vector<double> ranks(nranks * (1 + NumEvents));
+
+  for (size_t phase=0; phase<NumPhases; ++phase) {
+    double local[1 + NumEvents];
+    double total[1 + NumEvents];
+    local[0] = (double)intervals[phase];
+    for (size_t i=0; i<NumEvents; ++i) {
+      local[1 + i] = (double)totals[phase][i];
+    }
+    controller->Reduce(local, total, 1 + NumEvents, vtkCommunicator::SUM_OP, 0);
+    controller->Gather(local, ranks.data(), 1 + NumEvents, 0);
+
+    double lowest, highest;
+    controller->Reduce(&minIpc[phase], &lowest, 1, vtkCommunicator::MIN_OP, 0);
+    controller->Reduce(&maxIpc[phase], &highest, 1, vtkCommunicator::MAX_OP, 0);
+
+    if (controller->GetLocalProcessId() != 0 || total[0] == 0.0 || total[1 + Cycles] == 0.0) {
+      continue;
+    }
+
+    double kinstructions = total[1 + Instructions] / 1000.0;
+    fprintf(stderr, "perf %s: %.0f intervals, %.3g cycles, %.3g instructions, IPC %.2f (min %.2f, max %.2f), %.2f cache misses/kinstr, %.2f branch misses/kinstr\n",
+            name((Phase)phase), total[0], total[1 + Cycles], total[1 + Instructions],
+            total[1 + Instructions] / total[1 + Cycles], lowest, highest,
+            total[1 + CacheMisses] / kinstructions, total[1 + BranchMisses] / kinstructions);
+
+    // Ranks that never entered the phase are left out.
+    int fewest = -1, most = -1, slowest = -1, fastest = -1;
+    auto cycles = [&](int rank) { return ranks[rank * (1 + NumEvents) + 1 + Cycles]; };
+    auto ipc = [&](int rank) { return ranks[rank * (1 + NumEvents) + 1 + Instructions] / cycles(rank); };
+    for (int rank=0; rank<nranks; ++rank) {
+      if (cycles(rank) == 0.0) {
+        continue;
+      }
+      if (fewest < 0 || cycles(rank) < cycles(fewest)) fewest = rank;
+      if (most < 0 || cycles(rank) > cycles(most)) most = rank;
+      if (slowest < 0 || ipc(rank) < ipc(slowest)) slowest = rank;
+      if (fastest < 0 || ipc(rank) > ipc(fastest)) fastest = rank;
+    }
+
+    fprintf(stderr, "perf %s per rank: cycles min %.3g (rank %d), max %.3g (rank %d), IPC min %.2f (rank %d), max %.2f (rank %d)\n",
+            name((Phase)phase), cycles(fewest), fewest, cycles(most), most,
+            ipc(slowest), slowest, ipc(fastest), fastest);
+  }
+}
+
+#define PERF_OPEN() perfCounters.open()
+#define PERF_BEGIN(sample, phase) PerfCounters::Sample sample = perfCounters.read(PerfCounters::phase)
+#define PERF_END(sample, phase) perfCounters.add(PerfCounters::phase, sample)
+#define PERF_REPORT(controller) perfCounters.report(controller)
+
+#else
+
+#define PERF_OPEN() do {} while (0)
+#define PERF_BEGIN(sample, phase) do {} while (0)
+#define PERF_END(sample, phase) do {} while (0)
+#define PERF_REPORT(controller) do {} while (0)
+
+#endif
+
+
 //---
 
 struct Assignment {
@@ -281,63 +1439,233 @@ static void writePPM(const char *fileName, int size_x, int size_y, const uint32_
 
 //---
 
-int main(int argc, char **argv) {
-  int provided;
-  int success = MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
-  if (success != MPI_SUCCESS) {
-    fprintf(stderr, "Error while initializing MPI\n");
-    return 1;
+// helper function to write one rank's grid as a VTK XML unstructured grid
+// piece with raw appended data, returns the number of bytes written or 0 on
+// failure
+static size_t writeVTU(const char *fileName, vtkUnstructuredGrid *unstructuredGrid) {
+  using namespace std;
+
+  FILE *file = fopen(fileName, "wb");
+  if (!file) {
+    fprintf(stderr, "fopen('%s', 'wb') failed: %d", fileName, errno);
+    return 0;
   }
 
-  if (provided != MPI_THREAD_MULTIPLE) {
-    fprintf(stderr, "MPI provided the wrong level of thread support\n");
-    return 1;
+  vtkDoubleArray *points = vtkDoubleArray::SafeDownCast(unstructuredGrid->GetPoints()->GetData());
+  vtkTypeInt64Array *connectivity = vtkTypeInt64Array::SafeDownCast(unstructuredGrid->GetCells()->GetConnectivityArray());
+  vtkTypeInt64Array *offsets = vtkTypeInt64Array::SafeDownCast(unstructuredGrid->GetCells()->GetOffsetsArray());
+  vtkUnsignedCharArray *types = unstructuredGrid->GetCellTypesArray();
+  vtkUnsignedShortArray *nsteps = vtkUnsignedShortArray::SafeDownCast(unstructuredGrid->GetCellData()->GetAbstractArray("nsteps"));
+
+  uint64_t npoints = unstructuredGrid->GetNumberOfPoints();
+  uint64_t ncells = unstructuredGrid->GetNumberOfCells();
+
+  // VTK's offsets array starts with a leading 0 that the XML format omits
+  struct Block { const void *data; uint64_t bytes; };
+  Block blocks[5] = {
+    { points->GetPointer(0), 3 * npoints * sizeof(double) },
+    { connectivity->GetPointer(0), connectivity->GetNumberOfValues() * sizeof(int64_t) },
+    { offsets->GetPointer(1), ncells * sizeof(int64_t) },
+    { types->GetPointer(0), ncells * sizeof(uint8_t) },
+    { nsteps->GetPointer(0), ncells * sizeof(uint16_t) },
+  };
+
+  uint64_t offset[5];
+  for (size_t i=0, o=0; i<5; o += sizeof(uint64_t) + blocks[i].bytes, ++i) {
+    offset[i] = o;
   }
 
-  using Controller = vtkMPIController;
-  vtkNew<Controller> controller;
-  controller->Initialize(&argc, &argv, /* initializedExternally= */1);
-  struct guard {
-    guard(Controller *c) { vtkMultiProcessController::SetGlobalController(c); };
-    // ~guard() { vtkMultiProcessController::GetGlobalController()->Finalize(); };
-  } guard(controller);
+  const uint16_t one = 1;
+  const char *byteOrder = *reinterpret_cast<const uint8_t *>(&one) == 1 ? "LittleEndian" : "BigEndian";
+
+  fprintf(file,
+    "<?xml version=\"1.0\"?>\n"
+    "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n"
+    "  <UnstructuredGrid>\n"
+    "    <Piece NumberOfPoints=\"%llu\" NumberOfCells=\"%llu\">\n"
+    "      <Points>\n"
+    "        <DataArray type=\"Float64\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%llu\"/>\n"
+    "      </Points>\n"
+    "      <Cells>\n"
+    "        <DataArray type=\"Int64\" Name=\"connectivity\" format=\"appended\" offset=\"%llu\"/>\n"
+    "        <DataArray type=\"Int64\" Name=\"offsets\" format=\"appended\" offset=\"%llu\"/>\n"
+    "        <DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"%llu\"/>\n"
+    "      </Cells>\n"
+    "      <CellData Scalars=\"nsteps\">\n"
+    "        <DataArray type=\"UInt16\" Name=\"nsteps\" format=\"appended\" offset=\"%llu\"/>\n"
+    "      </CellData>\n"
+    "    </Piece>\n"
+    "  </UnstructuredGrid>\n"
+    "  <AppendedData encoding=\"raw\">\n"
+    "   _",
+    byteOrder,
+    (unsigned long long)npoints, (unsigned long long)ncells,
+    (unsigned long long)offset[0], (unsigned long long)offset[1],
+    (unsigned long long)offset[2], (unsigned long long)offset[3],
+    (unsigned long long)offset[4]);
+
+  for (size_t i=0; i<5; ++i) {
+    fwrite(&blocks[i].bytes, sizeof(uint64_t), 1, file);
+    fwrite(blocks[i].data, 1, blocks[i].bytes, file);
+  }
 
-#define DEBUG(Msg)                                                             \
-  do {                                                                         \
-    for (size_t _DEBUG_i=0; _DEBUG_i<opt_nprocs; ++_DEBUG_i) {                 \
-      if (controller->Barrier(), _DEBUG_i == opt_rank) {                       \
-        std::cout << opt_rank << ": " Msg << std::endl << std::flush;          \
-      }                                                                        \
-    }                                                                          \
-  } while (0)
+  fprintf(file,
+    "\n"
+    "  </AppendedData>\n"
+    "</VTKFile>\n");
+
+  // flush to the device so the caller's timing measures the write rather
+  // than the copy into the page cache
+  long end = ftell(file);
+  bool ok = end >= 0 && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (!ok) {
+    fprintf(stderr, "writing '%s' failed: %d", fileName, errno);
+  }
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  return ok ? (size_t)end : 0;
+}
 
-#define DEBUG_RANK0(Msg)                                                       \
-  do {                                                                         \
-    if (controller->Barrier(), opt_rank == 0) {                                \
-      std::cout Msg << std::endl << std::flush;                                \
-    }                                                                          \
-  } while (0)
+// helper function to write the index of all ranks' .vtu pieces
+static void writePVTU(const char *fileName, const std::vector<std::string> &pieces) {
+  using namespace std;
+
+  FILE *file = fopen(fileName, "wb");
+  if (!file) {
+    fprintf(stderr, "fopen('%s', 'wb') failed: %d", fileName, errno);
+    return;
+  }
+
+  const uint16_t one = 1;
+  const char *byteOrder = *reinterpret_cast<const uint8_t *>(&one) == 1 ? "LittleEndian" : "BigEndian";
+
+  fprintf(file,
+    "<?xml version=\"1.0\"?>\n"
+    "<VTKFile type=\"PUnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n"
+    "  <PUnstructuredGrid GhostLevel=\"0\">\n"
+    "    <PPoints>\n"
+    "      <PDataArray type=\"Float64\" NumberOfComponents=\"3\"/>\n"
+    "    </PPoints>\n"
+    "    <PCellData Scalars=\"nsteps\">\n"
+    "      <PDataArray type=\"UInt16\" Name=\"nsteps\"/>\n"
+    "    </PCellData>\n",
+    byteOrder);
+
+  for (const std::string &piece : pieces) {
+    fprintf(file, "    <Piece Source=\"%s\"/>\n", piece.c_str());
+  }
+
+  fprintf(file,
+    "  </PUnstructuredGrid>\n"
+    "</VTKFile>\n");
+
+  fclose(file);
+}
+
+
+//---
+
+// helper function to wrap one block's nsteps as a cell-centered structured
+// volume instance; the nsteps are shared with OSPRay, not copied, so they
+// must stay valid until the instance is released. A sub-box of a larger
+// array is wrapped by passing that array's x and y dimensions as pitches.
+static OSPInstance newBrickInstance(const Mandelbrot::BoundsF &bounds, size_t nx, size_t ny, size_t nz, const Mandelbrot::ScalarU *nsteps, OSPTransferFunction transferFunction, size_t pitchx=0, size_t pitchy=0) {
+  pitchx = pitchx == 0 ? nx : pitchx;
+  pitchy = pitchy == 0 ? ny : pitchy;
+  OSPData data = ospNewSharedData(nsteps, OSP_USHORT,
+                                  nx, sizeof(*nsteps),
+                                  ny, pitchx * sizeof(*nsteps),
+                                  nz, pitchx * pitchy * sizeof(*nsteps));
+  ospCommit(data);
+
+  OSPVolume volume = ospNewVolume("structuredRegular");
+  // https://ospray.org/documentation.html#structured-regular-volume
+  ospSetVec3f(volume, "gridOrigin",
+              std::get<Mandelbrot::MinX>(bounds),
+              std::get<Mandelbrot::MinY>(bounds),
+              std::get<Mandelbrot::MinZ>(bounds));
+  ospSetVec3f(volume, "gridSpacing",
+              (std::get<Mandelbrot::MaxX>(bounds) - std::get<Mandelbrot::MinX>(bounds)) / nx,
+              (std::get<Mandelbrot::MaxY>(bounds) - std::get<Mandelbrot::MinY>(bounds)) / ny,
+              (std::get<Mandelbrot::MaxZ>(bounds) - std::get<Mandelbrot::MinZ>(bounds)) / nz);
+  ospSetBool(volume, "cellCentered", true);
+  ospSetObject(volume, "data", data);
+  ospCommit(volume);
+
+  OSPVolumetricModel volumetricModel = ospNewVolumetricModel(nullptr);
+  ospSetObject(volumetricModel, "volume", volume);
+  ospSetObject(volumetricModel, "transferFunction", transferFunction);
+  ospCommit(volumetricModel);
+
+  OSPGroup group = ospNewGroup();
+  ospSetObjectAsData(group, "volume", OSP_VOLUMETRIC_MODEL, volumetricModel);
+  ospCommit(group);
+
+  OSPInstance instance = ospNewInstance(nullptr);
+  ospSetObject(instance, "group", group);
+  ospCommit(instance);
 
-  size_t opt_rank;
-  size_t opt_nprocs;
-  size_t opt_nx;
-  size_t opt_ny;
-  size_t opt_nz;
-  size_t opt_nxcuts;
-  size_t opt_nycuts;
-  size_t opt_nzcuts;
-  size_t opt_nsteps;
-  float opt_xmin;
-  float opt_ymin;
-  float opt_zmin;
-  float opt_xmax;
-  float opt_ymax;
-  float opt_zmax;
-  bool opt_enable_d3;
-  int opt_width;
-  int opt_height;
-  int opt_spp;
+  ospRelease(group);
+  ospRelease(volumetricModel);
+  ospRelease(volume);
+  ospRelease(data);
 
+  return instance;
+}
+
+
+//---
+
+// Every job in a batch starts from the defaults and the command line
+// arguments, then applies its own line from the job file on top.
+static size_t opt_rank;
+static size_t opt_nprocs;
+static size_t opt_nx;
+static size_t opt_ny;
+static size_t opt_nz;
+static size_t opt_nxcuts;
+static size_t opt_nycuts;
+static size_t opt_nzcuts;
+static size_t opt_nsteps;
+static Mandelbrot::Kernel opt_kernel;
+static float opt_power;
+static float opt_xmin;
+static float opt_ymin;
+static float opt_zmin;
+static float opt_xmax;
+static float opt_ymax;
+static float opt_zmax;
+static bool opt_enable_d3;
+static int opt_width;
+static int opt_height;
+static int opt_spp;
+static bool opt_progressive;
+static float opt_target_error;
+static float opt_time_budget;
+static float opt_camx;
+static float opt_camy;
+static float opt_camz;
+static float opt_camdx;
+static float opt_camdy;
+static float opt_camdz;
+static std::string opt_batch;
+static size_t opt_batch_groups;
+static bool opt_cache;
+static std::string opt_cache_dir;
+static size_t opt_cache_mem;
+static std::string opt_write_data;
+static std::string opt_ooc_dir;
+static size_t opt_ooc_mem;
+static bool opt_hybrid;
+static int opt_threads;
+static size_t opt_summary_brick;
+static bool opt_preview;
+static Mandelbrot::ScalarU opt_empty_below;
+static bool opt_d3_minimal_memory;
+static bool opt_validate;
+
+static void defaults(vtkMultiProcessController *controller) {
   opt_rank = controller->GetLocalProcessId();
   opt_nprocs = controller->GetNumberOfProcesses();
   opt_nx = 16;
@@ -347,6 +1675,8 @@ int main(int argc, char **argv) {
   opt_nycuts = 4;
   opt_nzcuts = 4;
   opt_nsteps = 16;
+  opt_kernel = Mandelbrot::Multibrot;
+  opt_power = 0.0f;
   opt_xmin = -2.0f;
   opt_ymin = -2.0f;
   opt_zmin = 2.0f;
@@ -356,7 +1686,32 @@ int main(int argc, char **argv) {
   opt_enable_d3 = false;
   opt_width = 256;
   opt_height = 256;
-  opt_spp = 1;
+  opt_spp = 0;
+  opt_progressive = false;
+  opt_target_error = 0.0f;
+  opt_time_budget = 0.0f;
+  opt_camx = 0.0f;
+  opt_camy = 0.0f;
+  opt_camz = 10.0f;
+  opt_camdx = 0.0f;
+  opt_camdy = 0.0f;
+  opt_camdz = -1.0f;
+  opt_batch = "";
+  opt_batch_groups = 1;
+  opt_cache = false;
+  opt_cache_dir = "";
+  opt_cache_mem = 1024;
+  opt_write_data = "";
+  opt_ooc_dir = "";
+  opt_ooc_mem = 256;
+  opt_hybrid = false;
+  opt_threads = 0;
+  opt_summary_brick = 8;
+  opt_preview = false;
+  opt_empty_below = 0;
+  opt_d3_minimal_memory = true;
+  opt_validate = false;
+}
 
 #define ARGLOOP \
   if (char *ARGVAL=nullptr) \
@@ -369,6 +1724,7 @@ int main(int argc, char **argv) {
 #define ARG(s) \
       else if (strncmp(argv[ARGIND], s, sizeof(s)) == 0 && ++ARGIND < argc && (ARGVAL = argv[ARGIND], 1))
 
+static void parse(int argc, char **argv) {
   ARGLOOP
   ARG("-rank") opt_rank = (size_t)std::stoull(ARGVAL);
   ARG("-nprocs") opt_nprocs = (size_t)std::stoull(ARGVAL);
@@ -379,6 +1735,11 @@ int main(int argc, char **argv) {
   ARG("-nycuts") opt_nycuts = (size_t)std::stoull(ARGVAL);
   ARG("-nzcuts") opt_nzcuts = (size_t)std::stoull(ARGVAL);
   ARG("-nsteps") opt_nsteps = (size_t)std::stoull(ARGVAL);
+  ARG("-kernel") opt_kernel = (
+    strcmp(ARGVAL, "burningship") == 0 ? Mandelbrot::BurningShip :
+    strcmp(ARGVAL, "mandelbulb") == 0 ? Mandelbrot::Mandelbulb :
+    Mandelbrot::Multibrot);
+  ARG("-power") opt_power = std::stof(ARGVAL);
   ARG("-xmin") opt_xmin = std::stof(ARGVAL);
   ARG("-ymin") opt_ymin = std::stof(ARGVAL);
   ARG("-zmin") opt_zmin = std::stof(ARGVAL);
@@ -389,10 +1750,84 @@ int main(int argc, char **argv) {
   ARG("-width") opt_width = std::stoi(ARGVAL);
   ARG("-height") opt_height = std::stoi(ARGVAL);
   ARG("-spp") opt_spp = std::stoi(ARGVAL);
+  ARG("-progressive") opt_progressive = (bool)std::stoi(ARGVAL);
+  ARG("-target-error") opt_target_error = std::stof(ARGVAL);
+  ARG("-time-budget") opt_time_budget = std::stof(ARGVAL);
+  ARG("-camx") opt_camx = std::stof(ARGVAL);
+  ARG("-camy") opt_camy = std::stof(ARGVAL);
+  ARG("-camz") opt_camz = std::stof(ARGVAL);
+  ARG("-camdx") opt_camdx = std::stof(ARGVAL);
+  ARG("-camdy") opt_camdy = std::stof(ARGVAL);
+  ARG("-camdz") opt_camdz = std::stof(ARGVAL);
+  ARG("-batch") opt_batch = ARGVAL;
+  ARG("-batch-groups") opt_batch_groups = (size_t)std::stoull(ARGVAL);
+  ARG("-cache") opt_cache = (bool)std::stoi(ARGVAL);
+  ARG("-cache-dir") opt_cache_dir = ARGVAL;
+  ARG("-cache-mem") opt_cache_mem = (size_t)std::stoull(ARGVAL);
+  ARG("-write-data") opt_write_data = ARGVAL;
+  ARG("-ooc-dir") opt_ooc_dir = ARGVAL;
+  ARG("-ooc-mem") opt_ooc_mem = (size_t)std::stoull(ARGVAL);
+  ARG("-hybrid") opt_hybrid = (bool)std::stoi(ARGVAL);
+  ARG("-threads") opt_threads = std::stoi(ARGVAL);
+  ARG("-summary-brick") opt_summary_brick = std::max<size_t>(1, (size_t)std::stoull(ARGVAL));
+  ARG("-preview") opt_preview = (bool)std::stoi(ARGVAL);
+  ARG("-empty-below") opt_empty_below = (Mandelbrot::ScalarU)std::stoul(ARGVAL);
+  ARG("-d3-minimal-memory") opt_d3_minimal_memory = (bool)std::stoi(ARGVAL);
+  ARG("-validate") opt_validate = (bool)std::stoi(ARGVAL);
+}
 
 #undef ARG
 #undef ARGLOOP
 
+
+//---
+
+// Device, renderer, camera and light are created once and shared by all
+// jobs; only the data-dependent objects are rebuilt per job. The cache
+// lives for the whole session too, so later jobs in a batch reuse blocks
+// computed by earlier ones.
+struct Session {
+  Session(std::string cacheDirectory, size_t cacheCapacity)
+    : cache(cacheDirectory, cacheCapacity)
+  {
+  }
+
+  OSPDevice device{nullptr};
+  OSPLight light{nullptr};
+  OSPCamera camera{nullptr};
+  OSPRenderer renderer{nullptr};
+  OSPFrameBuffer frameBuffer{nullptr};
+  int frameBufferWidth{0};
+  int frameBufferHeight{0};
+  bool frameBufferVariance{false};
+  bool local{false};
+  BlockCache cache;
+  bool cacheUsed{false};  // by any job on this rank; -cache is per job
+  unsigned long validateProblems{0};
+};
+
+#define DEBUG(Msg)                                                             \
+  do {                                                                         \
+    for (size_t _DEBUG_i=0; _DEBUG_i<opt_nprocs; ++_DEBUG_i) {                 \
+      if (controller->Barrier(), _DEBUG_i == opt_rank) {                       \
+        std::cout << opt_rank << ": " Msg << std::endl << std::flush;          \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define DEBUG_RANK0(Msg)                                                       \
+  do {                                                                         \
+    if (controller->Barrier(), opt_rank == 0) {                                \
+      std::cout Msg << std::endl << std::flush;                                \
+    }                                                                          \
+  } while (0)
+
+// Runs one job of a batch with the options as parsed for it; the objects
+// in `session` are shared by all jobs.
+static void runJob(size_t jobi, vtkMultiProcessController *controller, Session &session) {
+  double jobStart = MPI_Wtime();
+  session.cacheUsed = session.cacheUsed || opt_cache;
+
   std::vector<Assignment> assignments;
   for (size_t i=0, xi=0; xi<opt_nxcuts; ++xi) {
     for (size_t yi=0; yi<opt_nycuts; ++yi) {
@@ -402,10 +1837,10 @@ int main(int argc, char **argv) {
     }
   }
 
-  std::vector<Mandelbrot> mandelbrots;
+  std::vector<Mandelbrot::BoundsF> blockBounds;
   for (size_t i=0; i<assignments.size(); ++i) {
     if (assignments[i].rank == opt_rank) {
-      mandelbrots.emplace_back(opt_nx, opt_ny, opt_nz, Mandelbrot::BoundsF({
+      blockBounds.emplace_back(Mandelbrot::BoundsF({
         opt_xmin + (opt_xmax - opt_xmin) / opt_nxcuts * (assignments[i].xindex + 0),
         opt_ymin + (opt_ymax - opt_ymin) / opt_nycuts * (assignments[i].yindex + 0),
         opt_zmin + (opt_zmax - opt_zmin) / opt_nzcuts * (assignments[i].zindex + 0),
@@ -416,57 +1851,399 @@ int main(int argc, char **argv) {
     }
   }
 
-  for (size_t i=0; i<mandelbrots.size(); ++i) {
-    mandelbrots[i].step(opt_nsteps);
+  // The summaries outlive the blocks themselves (out-of-core mode drops
+  // them after each batch) and are indexed like blockBounds.
+  struct BlockSummary {
+    Mandelbrot::BoundsF bounds;
+    size_t cx, cy, cz;
+    std::vector<Mandelbrot::ScalarU> summary;
+    Mandelbrot::ScalarU max;
+  };
+  std::vector<BlockSummary> summaries;
+
+  auto compute = [&](Mandelbrot &mandelbrot) {
+    mandelbrot.brick = opt_summary_brick;
+
+    double seconds = 0.0;
+    if (opt_cache) {
+      session.cache.load(mandelbrot, opt_nsteps, seconds);
+    }
+
+    double start = MPI_Wtime();
+    if (mandelbrot.niters < opt_nsteps) {
+      PERF_BEGIN(stepSample, Step);
+      mandelbrot.step(opt_nsteps - mandelbrot.niters);
+      PERF_END(stepSample, Step);
+    }
+
+    if (opt_cache) {
+      session.cache.store(mandelbrot, seconds + (MPI_Wtime() - start));
+    }
+
+    if (mandelbrot.summary.empty()) {
+      mandelbrot.summarize();
+    }
+    summaries.push_back({ mandelbrot.bounds, mandelbrot.cx, mandelbrot.cy, mandelbrot.cz, mandelbrot.summary, mandelbrot.summaryMax() });
+  };
+
+  // Structured mode renders each block directly from its nsteps as a
+  // brick, skipping the VTK expansion (and therefore D3 and -write-data).
+  bool structured = !opt_ooc_dir.empty() || opt_hybrid;
+  std::vector<std::pair<Mandelbrot::BoundsF, const Mandelbrot::ScalarU *>> bricks;
+  if (structured && opt_rank == 0 && (opt_enable_d3 || !opt_write_data.empty())) {
+    fprintf(stderr, "Warning: -d3 and -write-data are ignored when rendering blocks as bricks\n");
   }
 
-  if (controller->Barrier(), opt_rank == 0) {
-    mandelbrots[0].debug(Mandelbrot::Debug::OnlyNsteps);
+  double computeStart = MPI_Wtime();
+  std::vector<Mandelbrot> mandelbrots;
+  const Mandelbrot::ScalarU *mapped{nullptr};
+  size_t mappedBytes{0};
+
+  if (opt_ooc_dir.empty()) {
+    for (size_t i=0; i<blockBounds.size(); ++i) {
+      mandelbrots.emplace_back(opt_nx, opt_ny, opt_nz, blockBounds[i], opt_kernel, opt_power);
+      compute(mandelbrots.back());
+    }
+
+    if (controller->Barrier(), opt_rank == 0) {
+      mandelbrots[0].debug(Mandelbrot::Debug::OnlyNsteps);
+    }
+
+    if (structured) {
+      for (size_t i=0; i<mandelbrots.size(); ++i) {
+        if (summaries[i].max >= opt_empty_below) {
+          bricks.emplace_back(mandelbrots[i].bounds, mandelbrots[i].nsteps.data());
+        }
+      }
+    }
+
+  } else {
+    // Out-of-core: blocks are computed in batches that fit in -ooc-mem MiB
+    // and only their nsteps survive, written to a per-rank file that is
+    // mapped back read-only and handed to OSPRay without copying. The file
+    // is unlinked once mapped, so it goes away with the mapping.
+    size_t ncells = opt_nx * opt_ny * opt_nz;
+    size_t blockBytes = ncells * (Mandelbrot::ncomponents(opt_kernel) * sizeof(Mandelbrot::ScalarF) + sizeof(Mandelbrot::ScalarU));
+
+    // The cache holds full copies of blocks too, so it has to share
+    // -ooc-mem with the batch: it gets at most half for this job.
+    size_t cacheCapacity = session.cache.capacity;
+    size_t cacheBudget = opt_cache ? std::min(cacheCapacity, (opt_ooc_mem << 20) / 2) : 0;
+    if (opt_cache) {
+      session.cache.capacity = cacheBudget;
+      session.cache.evict();
+    }
+    size_t batchSize = std::max<size_t>(1, ((opt_ooc_mem << 20) - cacheBudget) / blockBytes);
+
+    if (mkdir(opt_ooc_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "mkdir('%s') failed: %d\n", opt_ooc_dir.c_str(), errno);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    std::string filename = opt_ooc_dir + "/nsteps." + (opt_batch.empty() ? std::string("") : std::string("job") + std::to_string(jobi) + ".") + std::to_string(opt_rank) + ".raw";
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "open('%s') failed: %d\n", filename.c_str(), errno);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    mappedBytes = blockBounds.size() * ncells * sizeof(Mandelbrot::ScalarU);
+    if (ftruncate(fd, mappedBytes) != 0) {
+      fprintf(stderr, "ftruncate('%s') failed: %d\n", filename.c_str(), errno);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (size_t first=0; first<blockBounds.size(); first+=batchSize) {
+      size_t last = std::min(first + batchSize, blockBounds.size());
+
+      std::vector<Mandelbrot> batch;
+      for (size_t i=first; i<last; ++i) {
+        batch.emplace_back(opt_nx, opt_ny, opt_nz, blockBounds[i], opt_kernel, opt_power);
+        compute(batch.back());
+      }
+
+      for (size_t i=first; i<last; ++i) {
+        const Mandelbrot &mandelbrot = batch[i - first];
+        size_t bytes = ncells * sizeof(Mandelbrot::ScalarU);
+        if (pwrite(fd, mandelbrot.nsteps.data(), bytes, i * bytes) != (ssize_t)bytes) {
+          fprintf(stderr, "pwrite('%s') failed: %d\n", filename.c_str(), errno);
+          MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+      }
+    }
+
+    if (mappedBytes > 0) {
+      void *p = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap('%s') failed: %d\n", filename.c_str(), errno);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+      mapped = static_cast<const Mandelbrot::ScalarU *>(p);
+    }
+    if (unlink(filename.c_str()) != 0) {
+      fprintf(stderr, "unlink('%s') failed: %d\n", filename.c_str(), errno);
+    }
+    close(fd);
+    session.cache.capacity = cacheCapacity;
+
+    for (size_t i=0; i<blockBounds.size(); ++i) {
+      if (summaries[i].max >= opt_empty_below) {
+        bricks.emplace_back(blockBounds[i], mapped + i * ncells);
+      }
+    }
+
+    DEBUG_RANK0(<< "ooc: " << blockBounds.size() << " blocks in batches of " << batchSize << " (" << (batchSize * blockBytes >> 20) << " MiB working set" << (opt_cache ? ", " + std::to_string(cacheBudget >> 20) + " MiB cache" : std::string("")) << ")");
   }
 
-  using UnstructuredGrid = vtkUnstructuredGrid;
-  vtkSmartPointer<UnstructuredGrid> unstructuredGrid = nullptr;
-  for (size_t i=0; i<mandelbrots.size(); ++i) {
-    unstructuredGrid = mandelbrots[i].vtk(unstructuredGrid);
+  DEBUG_RANK0(<< "compute: " << (MPI_Wtime() - computeStart) << "s");
+
+  ospSetFloat(session.camera, "aspect", (float)opt_width / (float)opt_height);
+  ospSetVec3f(session.camera, "position", opt_camx, opt_camy, opt_camz);
+  ospSetVec3f(session.camera, "direction", opt_camdx, opt_camdy, opt_camdz);
+  ospSetVec3f(session.camera, "up", 0.0f, 1.0f, 0.0f);
+  ospCommit(session.camera);
+
+  if (opt_empty_below > 0) {
+    size_t skipped = std::count_if(summaries.begin(), summaries.end(), [&](const BlockSummary &summary) { return summary.max < opt_empty_below; });
+    DEBUG_RANK0(<< "empty-below: " << skipped << " of " << summaries.size() << " blocks skipped on rank 0");
   }
 
-  unstructuredGrid->GetCellData()->SetActiveScalars("nsteps");
+  // The preview renders each block's mean summary as a low-resolution
+  // structured volume, before the VTK expansion, D3 and full-resolution
+  // volume setup, which is where most of the time goes on large data.
+  if (opt_preview) {
+    double previewStart = MPI_Wtime();
+
+    float previewColor[6] = {
+      (opt_rank % 3 == 0 ? 1.0f : 0.0f),
+      (opt_rank % 3 == 1 ? 1.0f : 0.0f),
+      (opt_rank % 3 == 2 ? 1.0f : 0.0f),
+      (opt_rank % 3 == 0 ? 1.0f : 0.0f),
+      (opt_rank % 3 == 1 ? 1.0f : 0.0f),
+      (opt_rank % 3 == 2 ? 1.0f : 0.0f),
+    };
+    OSPData previewColorData = ospNewSharedData(previewColor, OSP_VEC3F, 2);
+    ospCommit(previewColorData);
+
+    float previewOpacity[2] = { 0.0f, 1.0f };
+    OSPData previewOpacityData = ospNewSharedData(previewOpacity, OSP_FLOAT, 2);
+    ospCommit(previewOpacityData);
+
+    OSPTransferFunction previewTransferFunction = ospNewTransferFunction("piecewiseLinear");
+    ospSetObject(previewTransferFunction, "color", previewColorData);
+    ospSetObject(previewTransferFunction, "opacity", previewOpacityData);
+    ospSetVec2f(previewTransferFunction, "valueRange", (float)opt_empty_below, (float)opt_nsteps);
+    ospCommit(previewTransferFunction);
+
+    std::vector<OSPInstance> previewInstances;
+    std::vector<float> previewRegion;
+    for (const BlockSummary &summary : summaries) {
+      if (summary.max < opt_empty_below) {
+        continue;
+      }
+
+      // When the block size isn't a multiple of the brick size, the last
+      // summary cell along an axis covers fewer than `brick` cells, which a
+      // single regular grid can't express. Each axis is split into the run
+      // of whole bricks and the partial one, and every combination becomes
+      // its own instance over the same summary, so nothing overhangs the
+      // block whether or not the device clips to regions.
+      struct Piece { size_t first, count; float min, max; };
+      auto pieces = [&](size_t n, size_t c, float min, float max) {
+        size_t whole = n / opt_summary_brick;
+        float split = min + (max - min) * (whole * opt_summary_brick) / n;
+        std::vector<Piece> result;
+        if (whole > 0) result.push_back({ 0, whole, min, split });
+        if (whole < c) result.push_back({ whole, c - whole, split, max });
+        return result;
+      };
+
+      const Mandelbrot::BoundsF &b = summary.bounds;
+      std::vector<Piece> xs = pieces(opt_nx, summary.cx, std::get<Mandelbrot::MinX>(b), std::get<Mandelbrot::MaxX>(b));
+      std::vector<Piece> ys = pieces(opt_ny, summary.cy, std::get<Mandelbrot::MinY>(b), std::get<Mandelbrot::MaxY>(b));
+      std::vector<Piece> zs = pieces(opt_nz, summary.cz, std::get<Mandelbrot::MinZ>(b), std::get<Mandelbrot::MaxZ>(b));
+
+      const Mandelbrot::ScalarU *mean = summary.summary.data() + Mandelbrot::SummaryMean * summary.cx * summary.cy * summary.cz;
+      previewRegion.insert(previewRegion.end(), b.begin(), b.end());
+      for (const Piece &x : xs) {
+        for (const Piece &y : ys) {
+          for (const Piece &z : zs) {
+            Mandelbrot::BoundsF bounds{ x.min, y.min, z.min, x.max, y.max, z.max };
+            const Mandelbrot::ScalarU *first = mean + x.first + summary.cx * (y.first + summary.cy * z.first);
+            previewInstances.push_back(newBrickInstance(bounds, x.count, y.count, z.count, first, previewTransferFunction, summary.cx, summary.cy));
+          }
+        }
+      }
+    }
+
+    // A rank whose blocks were all skipped still takes part in the frame,
+    // but with an empty world: OSPRay rejects zero-length data.
+    OSPData previewInstanceData{nullptr};
+    OSPData previewRegionData{nullptr};
+    if (!previewInstances.empty()) {
+      previewInstanceData = ospNewSharedData(previewInstances.data(), OSP_INSTANCE, previewInstances.size());
+      ospCommit(previewInstanceData);
+
+      previewRegionData = ospNewSharedData(previewRegion.data(), OSP_BOX3F, previewRegion.size() / 6);
+      ospCommit(previewRegionData);
+    }
+
+    OSPWorld previewWorld = ospNewWorld();
+    if (previewInstanceData != nullptr) {
+      ospSetObject(previewWorld, "instance", previewInstanceData);
+    }
+    ospSetObjectAsData(previewWorld, "light", OSP_LIGHT, session.light);
+    if (!session.local && previewRegionData != nullptr) {
+      ospSetObject(previewWorld, "region", previewRegionData);
+    }
+    ospCommit(previewWorld);
 
-  DEBUG(<< "opt_enable_d3: " << opt_enable_d3);
-  if (opt_enable_d3) {
-    using TimerLog = vtkTimerLog;
-    TimerLog::SetMaxEntries(2048);
+    ospSetInt(session.renderer, "pixelSamples", 1);
+    ospSetVec3f(session.renderer, "backgroundColor", 0.0f, 0.0f, 0.0f);
+    ospSetFloat(session.renderer, "varianceThreshold", 0.0f);
+    ospCommit(session.renderer);
 
-    using DistributedDataFilter = vtkPDistributedDataFilter;
-    vtkNew<DistributedDataFilter> distributedDataFilter;
-    distributedDataFilter->GetKdtree()->AssignRegionsRoundRobin();
-    distributedDataFilter->SetInputData(unstructuredGrid);
-    distributedDataFilter->SetBoundaryMode(0);
-    distributedDataFilter->SetUseMinimalMemory(1);
-    distributedDataFilter->SetMinimumGhostLevel(0);
-    distributedDataFilter->RetainKdtreeOn();
-    
-    // distributedDataFilter->UpdateDataObject();
-    // {
-    //   auto dataObject = distributedDataFilter->GetOutputDataObject(0);
-    //   auto grid = vtkUnstructuredGrid::SafeDownCast(dataObject);
-    //   auto points = vtkPoints::New();
-    //   points->SetDataType(VTK_FLOAT);
-    //   grid->SetPoints(points);
-    // }
+    OSPFrameBuffer previewFrameBuffer = ospNewFrameBuffer(opt_width, opt_height, OSP_FB_SRGBA, OSP_FB_COLOR);
+    ospCommit(previewFrameBuffer);
 
-    DEBUG_RANK0(<< "D3: " << *distributedDataFilter);
-    distributedDataFilter->Update();
+    OSPFuture previewFuture = ospRenderFrame(previewFrameBuffer, session.renderer, session.camera, previewWorld);
+    ospWait(previewFuture, OSP_TASK_FINISHED);
+    ospRelease(previewFuture);
 
-    using KdTree = vtkPKdTree;
-    vtkSmartPointer<KdTree> kdTree = distributedDataFilter->GetKdtree();
+    DEBUG_RANK0(<< "preview: " << (MPI_Wtime() - previewStart) << "s (" << opt_summary_brick << "^3 bricks)");
 
-    DEBUG_RANK0(<< "kdTree: " << *kdTree);
+    if (controller->Barrier(), opt_rank == 0) {
+      std::string filename = std::string("vtkOSPRay.preview.") + (opt_batch.empty() ? std::to_string(opt_rank) : std::string("job") + std::to_string(jobi)) + std::string(".ppm");
+      const void *fb = ospMapFrameBuffer(previewFrameBuffer, OSP_FB_COLOR);
+      writePPM(filename.c_str(), opt_width, opt_height, static_cast<const uint32_t *>(fb));
+      ospUnmapFrameBuffer(fb, previewFrameBuffer);
+    }
 
-    unstructuredGrid = UnstructuredGrid::SafeDownCast(distributedDataFilter->GetOutput());
+    ospRelease(previewFrameBuffer);
+    ospRelease(previewWorld);
+    ospRelease(previewRegionData);
+    ospRelease(previewInstanceData);
+    for (OSPInstance instance_ : previewInstances) {
+      ospRelease(instance_);
+    }
+    ospRelease(previewTransferFunction);
+    ospRelease(previewOpacityData);
+    ospRelease(previewColorData);
   }
 
-  DEBUG(<< "ugrid: " << *unstructuredGrid);
+  using UnstructuredGrid = vtkUnstructuredGrid;
+  vtkSmartPointer<UnstructuredGrid> unstructuredGrid = nullptr;
+  if (!structured) {
+    for (size_t i=0; i<mandelbrots.size(); ++i) {
+      PERF_BEGIN(vtkSample, Vtk);
+      unstructuredGrid = mandelbrots[i].vtk(unstructuredGrid, opt_empty_below);
+      PERF_END(vtkSample, Vtk);
+    }
+
+    unstructuredGrid->GetCellData()->SetActiveScalars("nsteps");
+
+    DEBUG(<< "opt_enable_d3: " << opt_enable_d3);
+    if (opt_enable_d3) {
+      using TimerLog = vtkTimerLog;
+      TimerLog::SetMaxEntries(2048);
+
+      using DistributedDataFilter = vtkPDistributedDataFilter;
+      vtkNew<DistributedDataFilter> distributedDataFilter;
+      distributedDataFilter->GetKdtree()->AssignRegionsRoundRobin();
+      distributedDataFilter->SetInputData(unstructuredGrid);
+      distributedDataFilter->SetBoundaryMode(0);
+      distributedDataFilter->SetUseMinimalMemory(opt_d3_minimal_memory);
+      distributedDataFilter->SetMinimumGhostLevel(0);
+      distributedDataFilter->RetainKdtreeOn();
+  
+      // distributedDataFilter->UpdateDataObject();
+      // {
+      //   auto dataObject = distributedDataFilter->GetOutputDataObject(0);
+      //   auto grid = vtkUnstructuredGrid::SafeDownCast(dataObject);
+      //   auto points = vtkPoints::New();
+      //   points->SetDataType(VTK_FLOAT);
+      //   grid->SetPoints(points);
+      // }
+
+      DEBUG_RANK0(<< "D3: " << *distributedDataFilter);
+
+      // -validate records every message D3 exchanges and cross-checks the
+      // sizes between ranks once it is done.
+#ifdef ENABLE_MESSAGE_VALIDATION
+      using Communicator = vtkMPICommunicator;
+      Communicator *communicator = Communicator::SafeDownCast(controller->GetCommunicator());
+      if (opt_validate) {
+        messageLog.enable(*communicator->GetMPIComm()->GetHandle());
+      }
+#endif
+
+      double d3Start = MPI_Wtime();
+      PERF_BEGIN(d3Sample, D3);
+      distributedDataFilter->Update();
+      PERF_END(d3Sample, D3);
+      DEBUG_RANK0(<< "d3: " << (MPI_Wtime() - d3Start) << "s");
+
+#ifdef ENABLE_MESSAGE_VALIDATION
+      if (opt_validate) {
+        unsigned long problems = messageLog.check();
+        unsigned long totalProblems = 0;
+        controller->Reduce(&problems, &totalProblems, 1, vtkCommunicator::SUM_OP, 0);
+        controller->Broadcast(&totalProblems, 1, 0);
+        session.validateProblems += totalProblems;
+
+        if (opt_rank == 0) {
+          fprintf(stderr, "validate: D3 exchange with %zu ranks %s (%lu problems)\n",
+                  opt_nprocs, totalProblems == 0 ? "ok" : "FAILED", totalProblems);
+        }
+      }
+#else
+      if (opt_validate) {
+        // Counted as a failure so that scripts checking the exit status
+        // don't take an unchecked run for a clean one.
+        session.validateProblems += 1;
+        if (opt_rank == 0) {
+          fprintf(stderr, "validate: -validate needs a build with -DENABLE_MESSAGE_VALIDATION=ON\n");
+        }
+      }
+#endif
+
+      using KdTree = vtkPKdTree;
+      vtkSmartPointer<KdTree> kdTree = distributedDataFilter->GetKdtree();
+
+      DEBUG_RANK0(<< "kdTree: " << *kdTree);
+
+      unstructuredGrid = UnstructuredGrid::SafeDownCast(distributedDataFilter->GetOutput());
+    }
+
+    DEBUG(<< "ugrid: " << *unstructuredGrid);
+
+    // Every rank writes its own piece independently; rank 0 additionally
+    // writes the small .pvtu index that references them by relative path.
+    if (!opt_write_data.empty()) {
+      std::string base = opt_write_data + (opt_batch.empty() ? std::string("") : std::string(".job") + std::to_string(jobi));
+      std::string dirname = base.find('/') == std::string::npos ? std::string("") : base.substr(0, base.rfind('/') + 1);
+
+      controller->Barrier();
+      double start = MPI_Wtime();
+      std::string filename = base + "." + std::to_string(opt_rank) + ".vtu";
+      double stats[2] = { (double)writeVTU(filename.c_str(), unstructuredGrid), MPI_Wtime() - start };
+
+      double bytes = 0.0;
+      double seconds = 0.0;
+      controller->Reduce(&stats[0], &bytes, 1, vtkCommunicator::SUM_OP, 0);
+      controller->Reduce(&stats[1], &seconds, 1, vtkCommunicator::MAX_OP, 0);
+
+      if (opt_rank == 0) {
+        std::vector<std::string> pieces;
+        for (size_t i=0; i<opt_nprocs; ++i) {
+          pieces.push_back(base.substr(dirname.size()) + "." + std::to_string(i) + ".vtu");
+        }
+        writePVTU((base + ".pvtu").c_str(), pieces);
+      }
+
+      DEBUG_RANK0(<< "write-data: " << bytes / (1 << 20) << " MiB in " << seconds << "s (" << bytes / (1 << 20) / seconds << " MiB/s)");
+    }
+  }
 
   // using CompositeDataIterator = vtkCompositeDataIterator;
   // vtkSmartPointer<CompositeDataIterator> compositeDataIterator = multiBlockDataSet->NewIterator();
@@ -563,7 +2340,6 @@ int main(int argc, char **argv) {
 
   // TODO(th): Try using the vtk rendering itself, without OSPRay
 
-  OSPDevice device{nullptr};
   std::vector<uint8_t> volumeCellType{};
   OSPData volumeCellTypeData{nullptr};
   std::vector<uint32_t> volumeCellIndex{};
@@ -583,146 +2359,146 @@ int main(int argc, char **argv) {
   OSPVolumetricModel volumetricModel{nullptr};
   OSPGroup group{nullptr};
   OSPInstance instance{nullptr};
-  OSPLight light{nullptr};
+  std::vector<OSPInstance> instances{};
+  OSPData instanceData{nullptr};
   std::vector<float> worldRegion;
   OSPData worldRegionData{nullptr};
   OSPWorld world{nullptr};
-  OSPCamera camera{nullptr};
-  OSPRenderer renderer{nullptr};
-  OSPFrameBuffer frameBuffer{nullptr};
   OSPFuture future;
+  OSPGeometry geometry{nullptr};
+  OSPMaterial material{nullptr};
+  OSPGeometricModel geometricModel{nullptr};
+
+  // A rank can end up with nothing to render: every block below
+  // -empty-below, or no cells left after D3. It gets no volume, instance
+  // or region (an empty grid's bounds are inverted, and OSPRay rejects
+  // zero-length data) but still renders its share of the frame.
+  bool empty = structured ? bricks.empty() : unstructuredGrid->GetNumberOfCells() == 0;
+
+  if (!structured && !empty) {
+    {
+      double bounds[6]; // xmin, xmax, ymin, ymax, zmin, zmax
+      unstructuredGrid->GetBounds(bounds);
+      worldRegion.insert(worldRegion.end(), {
+        bounds[0],
+        bounds[2],
+        bounds[4],
+        bounds[1],
+        bounds[3],
+        bounds[5],
+      });
+    }
 
-  ospLoadModule("mpi");
-
-  device = ospNewDevice("mpiDistributed");
-  ospDeviceCommit(device);
-  ospSetCurrentDevice(device);
+    {
+      using Array = vtkUnsignedCharArray;
+      Array *array = unstructuredGrid->GetCellTypesArray();
+      volumeCellType.resize(array->GetNumberOfValues(), 0);
+      for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
+        volumeCellType[i] = array->GetValue(i);
+      }
+      volumeCellTypeData = ospNewSharedData(volumeCellType.data(), OSP_UCHAR,
+                                            array->GetNumberOfTuples(), 0,
+                                            array->GetNumberOfComponents(), 0,
+                                            1, 0);
+      ospCommit(volumeCellTypeData);
+    }
 
-  {
-    double bounds[6]; // xmin, xmax, ymin, ymax, zmin, zmax
-    unstructuredGrid->GetBounds(bounds);
-    worldRegion.insert(worldRegion.end(), {
-      bounds[0],
-      bounds[2],
-      bounds[4],
-      bounds[1],
-      bounds[3],
-      bounds[5],
-    });
-  }
+    {
+      using Array = vtkIdTypeArray;
+      Array *array = unstructuredGrid->GetCellLocationsArray();
+      volumeCellIndex.resize(array->GetNumberOfValues(), 0);
+      for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
+        volumeCellIndex[i] = array->GetValue(i);
+      }
+      volumeCellIndexData =
+        ospNewSharedData(volumeCellIndex.data(), OSP_UINT,
+                         array->GetNumberOfTuples(), 0,
+                         array->GetNumberOfComponents(), 0,
+                         1, 0);
+      ospCommit(volumeCellIndexData);
+    }
 
-  {
-    using Array = vtkUnsignedCharArray;
-    Array *array = unstructuredGrid->GetCellTypesArray();
-    volumeCellType.resize(array->GetNumberOfValues(), 0);
-    for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
-      volumeCellType[i] = array->GetValue(i);
+    {
+      using Array = vtkDoubleArray;
+      Array *array = Array::SafeDownCast(unstructuredGrid->GetPoints()->GetData());
+      volumeVertexPosition.resize(array->GetNumberOfValues(), 0.0f);
+      for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
+        volumeVertexPosition[i] = array->GetValue(i);
+      }
+      volumeVertexPositionData =
+        ospNewSharedData(volumeVertexPosition.data(), OSP_VEC3F,
+                         array->GetNumberOfTuples(), 0,
+                         array->GetNumberOfComponents() / 3, 0,
+                         1, 0);
+      ospCommit(volumeVertexPositionData);
     }
-    volumeCellTypeData = ospNewSharedData(volumeCellType.data(), OSP_UCHAR,
-                                          array->GetNumberOfTuples(), 0,
-                                          array->GetNumberOfComponents(), 0,
-                                          1, 0);
-    ospCommit(volumeCellTypeData);
-  }
 
-  {
-    using Array = vtkIdTypeArray;
-    Array *array = unstructuredGrid->GetCellLocationsArray();
-    volumeCellIndex.resize(array->GetNumberOfValues(), 0);
-    for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
-      volumeCellIndex[i] = array->GetValue(i);
-    }
-    volumeCellIndexData =
-      ospNewSharedData(volumeCellIndex.data(), OSP_UINT,
-                       array->GetNumberOfTuples(), 0,
-                       array->GetNumberOfComponents(), 0,
-                       1, 0);
-    ospCommit(volumeCellIndexData);
-  }
+    {
+      using Array = vtkUnsignedShortArray;
+      Array *array = Array::SafeDownCast(unstructuredGrid->GetCellData()->GetScalars());
+      volumeCellData.resize(array->GetNumberOfValues(), 0.0f);
+      for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
+        volumeCellData[i] = array->GetValue(i);
+      }
+      volumeCellDataData =
+        ospNewSharedData(volumeCellData.data(), OSP_FLOAT,
+                         array->GetNumberOfTuples(), 0,
+                         array->GetNumberOfComponents(), 0,
+                         1, 0);
+      ospCommit(volumeCellDataData);
+    }
 
-  {
-    using Array = vtkDoubleArray;
-    Array *array = Array::SafeDownCast(unstructuredGrid->GetPoints()->GetData());
-    volumeVertexPosition.resize(array->GetNumberOfValues(), 0.0f);
-    for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
-      volumeVertexPosition[i] = array->GetValue(i);
-    }
-    volumeVertexPositionData =
-      ospNewSharedData(volumeVertexPosition.data(), OSP_VEC3F,
-                       array->GetNumberOfTuples(), 0,
-                       array->GetNumberOfComponents() / 3, 0,
-                       1, 0);
-    ospCommit(volumeVertexPositionData);
-  }
+    {
+      using Array = vtkTypeInt64Array;
+      Array *array = Array::SafeDownCast(unstructuredGrid->GetCells()->GetConnectivityArray());
+      volumeIndex.resize(array->GetNumberOfValues(), 0.0f);
+      for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
+        volumeIndex[i] = array->GetValue(i);
+      }
+      volumeIndexData =
+        ospNewSharedData(volumeIndex.data(), OSP_UINT,
+                         array->GetNumberOfTuples(), 0,
+                         array->GetNumberOfComponents(), 0,
+                         1, 0);
+      ospCommit(volumeIndexData);
+    }
 
-  {
-    using Array = vtkUnsignedShortArray;
-    Array *array = Array::SafeDownCast(unstructuredGrid->GetCellData()->GetScalars());
-    volumeCellData.resize(array->GetNumberOfValues(), 0.0f);
-    for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
-      volumeCellData[i] = array->GetValue(i);
-    }
-    volumeCellDataData =
-      ospNewSharedData(volumeCellData.data(), OSP_FLOAT,
-                       array->GetNumberOfTuples(), 0,
-                       array->GetNumberOfComponents(), 0,
-                       1, 0);
-    ospCommit(volumeCellDataData);
+    geometry = ospNewGeometry("sphere");
+    // https://ospray.org/documentation.html#geometries
+    // https://ospray.org/documentation.html#spheres
+    ospSetObject(geometry, "sphere.position", volumeVertexPositionData);
+    ospSetFloat(geometry, "radius", 0.01);
+    ospCommit(geometry);
+
+    material = ospNewMaterial(nullptr, "obj");
+    // https://ospray.org/documentation.html#materials
+    // https://ospray.org/documentation.html#obj-material
+    ospSetVec3f(material, "kd", 0.8, 0.8, 0.8);
+    ospCommit(material);
+
+    geometricModel = ospNewGeometricModel();
+    // https://ospray.org/documentation.html#geometries
+    // https://ospray.org/documentation.html#geometricmodels
+    ospSetObject(geometricModel, "geometry", geometry);
+    ospSetObject(geometricModel, "material", material);
+    ospCommit(geometricModel);
+
+    volume = ospNewVolume("unstructured");
+    // https://ospray.org/documentation.html#volumes
+    // https://ospray.org/documentation.html#unstructured-volume
+    ospSetObject(volume, "vertex.position", volumeVertexPositionData);
+    // ospSetObject(volume, "vertex.data", nullptr);
+    ospSetObject(volume, "index", volumeIndexData);
+    ospSetBool(volume, "indexPrefixed", false);
+    ospSetObject(volume, "cell.index", volumeCellIndexData);
+    ospSetObject(volume, "cell.data", volumeCellDataData);
+    ospSetObject(volume, "cell.type", volumeCellTypeData);
+    // ospSetBool(volume, "hexIterative", false);
+    // ospSetBool(volume, "precomputedNormals", false);
+    ospSetFloat(volume, "background", 0.0f);
+    ospCommit(volume);
   }
 
-  {
-    using Array = vtkTypeInt64Array;
-    Array *array = Array::SafeDownCast(unstructuredGrid->GetCells()->GetConnectivityArray());
-    volumeIndex.resize(array->GetNumberOfValues(), 0.0f);
-    for (size_t i=0; i<array->GetNumberOfValues(); ++i) {
-      volumeIndex[i] = array->GetValue(i);
-    }
-    volumeIndexData =
-      ospNewSharedData(volumeIndex.data(), OSP_UINT,
-                       array->GetNumberOfTuples(), 0,
-                       array->GetNumberOfComponents(), 0,
-                       1, 0);
-    ospCommit(volumeIndexData);
-  }
-
-  OSPGeometry geometry;
-  geometry = ospNewGeometry("sphere");
-  // https://ospray.org/documentation.html#geometries
-  // https://ospray.org/documentation.html#spheres
-  ospSetObject(geometry, "sphere.position", volumeVertexPositionData);
-  ospSetFloat(geometry, "radius", 0.01);
-  ospCommit(geometry);
-
-  OSPMaterial material;
-  material = ospNewMaterial(nullptr, "obj");
-  // https://ospray.org/documentation.html#materials
-  // https://ospray.org/documentation.html#obj-material
-  ospSetVec3f(material, "kd", 0.8, 0.8, 0.8);
-  ospCommit(material);
-
-  OSPGeometricModel geometricModel;
-  geometricModel = ospNewGeometricModel();
-  // https://ospray.org/documentation.html#geometries
-  // https://ospray.org/documentation.html#geometricmodels
-  ospSetObject(geometricModel, "geometry", geometry);
-  ospSetObject(geometricModel, "material", material);
-  ospCommit(geometricModel);
-
-  volume = ospNewVolume("unstructured");
-  // https://ospray.org/documentation.html#volumes
-  // https://ospray.org/documentation.html#unstructured-volume
-  ospSetObject(volume, "vertex.position", volumeVertexPositionData);
-  // ospSetObject(volume, "vertex.data", nullptr);
-  ospSetObject(volume, "index", volumeIndexData);
-  ospSetBool(volume, "indexPrefixed", false);
-  ospSetObject(volume, "cell.index", volumeCellIndexData);
-  ospSetObject(volume, "cell.data", volumeCellDataData);
-  ospSetObject(volume, "cell.type", volumeCellTypeData);
-  // ospSetBool(volume, "hexIterative", false);
-  // ospSetBool(volume, "precomputedNormals", false);
-  ospSetFloat(volume, "background", 0.0f);
-  ospCommit(volume);
-
   transferFunctionColor.clear();
   transferFunctionColor.insert(transferFunctionColor.end(), {
     (opt_rank % 3 == 0 ? 1.0f : 0.0f),
@@ -746,70 +2522,382 @@ int main(int argc, char **argv) {
   transferFunction = ospNewTransferFunction("piecewiseLinear");
   ospSetObject(transferFunction, "color", transferFunctionColorData);
   ospSetObject(transferFunction, "opacity", transferFunctionOpacityData);
-  ospSetVec2f(transferFunction, "valueRange", (float)0.0f, (float)opt_nsteps);
+  ospSetVec2f(transferFunction, "valueRange", (float)opt_empty_below, (float)opt_nsteps);
   ospCommit(transferFunction);
 
-  volumetricModel = ospNewVolumetricModel(nullptr);
-  ospSetObject(volumetricModel, "volume", volume);
-  ospSetObject(volumetricModel, "transferFunction", transferFunction);
-  ospCommit(volumetricModel);
+  if (empty) {
+    // nothing to add
 
-  group = ospNewGroup();
-  ospSetObjectAsData(group, "volume", OSP_VOLUMETRIC_MODEL, volumetricModel);
-  // ospSetObjectAsData(group, "geometry", OSP_GEOMETRIC_MODEL, geometricModel);
-  ospCommit(group);
+  } else if (!structured) {
+    volumetricModel = ospNewVolumetricModel(nullptr);
+    ospSetObject(volumetricModel, "volume", volume);
+    ospSetObject(volumetricModel, "transferFunction", transferFunction);
+    ospCommit(volumetricModel);
 
-  instance = ospNewInstance(nullptr);
-  ospSetObject(instance, "group", group);
-  ospCommit(instance);
+    group = ospNewGroup();
+    ospSetObjectAsData(group, "volume", OSP_VOLUMETRIC_MODEL, volumetricModel);
+    // ospSetObjectAsData(group, "geometry", OSP_GEOMETRIC_MODEL, geometricModel);
+    ospCommit(group);
+
+    instance = ospNewInstance(nullptr);
+    ospSetObject(instance, "group", group);
+    ospCommit(instance);
+    instances.push_back(instance);
 
-  light = ospNewLight("ambient");
-  ospCommit(light);
+  } else {
+    for (size_t i=0; i<bricks.size(); ++i) {
+      const Mandelbrot::BoundsF &bounds = bricks[i].first;
+      worldRegion.insert(worldRegion.end(), bounds.begin(), bounds.end());
+      instances.push_back(newBrickInstance(bounds, opt_nx, opt_ny, opt_nz, bricks[i].second, transferFunction));
+    }
+  }
+
+  if (!empty) {
+    instanceData = ospNewSharedData(instances.data(), OSP_INSTANCE, instances.size());
+    ospCommit(instanceData);
 
-  worldRegionData =
-    ospNewSharedData(worldRegion.data(), OSP_BOX3F,
-                     worldRegion.size() / 6, 0,
-                     1, 0,
-                     1, 0);
-  ospCommit(worldRegionData);
+    worldRegionData =
+      ospNewSharedData(worldRegion.data(), OSP_BOX3F,
+                       worldRegion.size() / 6, 0,
+                       1, 0,
+                       1, 0);
+    ospCommit(worldRegionData);
+  }
 
   world = ospNewWorld();
-  ospSetObjectAsData(world, "instance", OSP_INSTANCE, instance);
-  ospSetObjectAsData(world, "light", OSP_LIGHT, light);
-  ospSetObject(world, "region", worldRegionData);
+  if (!empty) {
+    ospSetObject(world, "instance", instanceData);
+  }
+  ospSetObjectAsData(world, "light", OSP_LIGHT, session.light);
+  if (!session.local && !empty) {
+    ospSetObject(world, "region", worldRegionData);
+  }
   ospCommit(world);
 
-  camera = ospNewCamera("perspective");
-  ospSetFloat(camera, "aspect", (float)opt_width / (float)opt_height);
-  ospSetVec3f(camera, "position", 0.0f, 0.0f, 10.0f);
-  ospSetVec3f(camera, "direction", 0.0f, 0.0f, -1.0f);
-  ospSetVec3f(camera, "up", 0.0f, 1.0f, 0.0f);
-  ospCommit(camera);
+  // In progressive mode, -spp is the upper bound on accumulated frames
+  // (256 if not given) and each frame only takes a single sample per
+  // pixel. Tiles whose variance drops below -target-error stop being
+  // refined by OSPRay itself.
+  ospSetInt(session.renderer, "pixelSamples", opt_progressive ? 1 : std::max(1, opt_spp));
+  ospSetVec3f(session.renderer, "backgroundColor", 0.0f, 0.0f, 0.0f);
+  ospSetFloat(session.renderer, "varianceThreshold", opt_progressive ? opt_target_error : 0.0f);
+  ospCommit(session.renderer);
+
+  // The framebuffer is kept across jobs and only recreated when its
+  // dimensions or channels change.
+  if (session.frameBuffer == nullptr || session.frameBufferWidth != opt_width || session.frameBufferHeight != opt_height || session.frameBufferVariance != opt_progressive) {
+    if (session.frameBuffer != nullptr) {
+      ospRelease(session.frameBuffer);
+    }
+
+    session.frameBuffer = ospNewFrameBuffer(opt_width, opt_height, OSP_FB_SRGBA, OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_DEPTH | (opt_progressive ? OSP_FB_VARIANCE : 0));
+    ospCommit(session.frameBuffer);
+    session.frameBufferWidth = opt_width;
+    session.frameBufferHeight = opt_height;
+    session.frameBufferVariance = opt_progressive;
+  }
+
+  double renderStart = MPI_Wtime();
+  PERF_BEGIN(renderSample, Render);
+  ospResetAccumulation(session.frameBuffer);
+  if (!opt_progressive) {
+    future = ospRenderFrame(session.frameBuffer, session.renderer, session.camera, world);
+    ospWait(future, OSP_TASK_FINISHED);
+    ospRelease(future);
+    future = nullptr;
+
+  } else {
+    int frames = opt_spp > 0 ? opt_spp : 256;
+    bool cancelled = false;
+    using Communicator = vtkMPICommunicator;
+    MPI_Comm comm = *Communicator::SafeDownCast(controller->GetCommunicator())->GetMPIComm()->GetHandle();
+    controller->Barrier();
+    double start = MPI_Wtime();
+    for (int frame=0; frame<frames; ++frame) {
+      // A frame still in flight when the budget runs out is cancelled
+      // instead of waited for. Only rank 0 watches the clock: it posts the
+      // per-frame broadcast either when it cancels or once the frame is
+      // done, and the other ranks poll for it and cancel when it says so,
+      // so no rank keeps rendering tiles the others have given up on.
+      int cancel = 0;
+      bool posted = opt_rank != 0;
+      MPI_Request cancelRequest = MPI_REQUEST_NULL;
+      if (posted) {
+        MPI_Ibcast(&cancel, 1, MPI_INT, 0, comm, &cancelRequest);
+      }
+
+      future = ospRenderFrame(session.frameBuffer, session.renderer, session.camera, world);
+      while (!ospIsReady(future, OSP_TASK_FINISHED)) {
+        if (opt_rank == 0) {
+          std::fprintf(stderr, "\rframe %d: %3.0f%%", frame, 100.0f * ospGetProgress(future));
+        }
 
-  renderer = ospNewRenderer("mpiRaycast");
-  ospSetInt(renderer, "pixelSamples", opt_spp);
-  ospSetVec3f(renderer, "backgroundColor", 0.0f, 0.0f, 0.0f);
-  ospCommit(renderer);
+        if (!posted && opt_time_budget > 0.0f && MPI_Wtime() - start >= opt_time_budget) {
+          cancel = 1;
+          MPI_Ibcast(&cancel, 1, MPI_INT, 0, comm, &cancelRequest);
+          posted = true;
+          ospCancel(future);
+
+        } else if (opt_rank != 0 && cancelRequest != MPI_REQUEST_NULL) {
+          int arrived;
+          MPI_Test(&cancelRequest, &arrived, MPI_STATUS_IGNORE);
+          if (arrived && cancel) {
+            ospCancel(future);
+          }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      ospWait(future, OSP_TASK_FINISHED);
+      ospRelease(future);
+      future = nullptr;
 
-  frameBuffer = ospNewFrameBuffer(opt_width, opt_height, OSP_FB_SRGBA, OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_DEPTH);
-  ospCommit(frameBuffer);
+      if (!posted) {
+        MPI_Ibcast(&cancel, 1, MPI_INT, 0, comm, &cancelRequest);
+      }
+      MPI_Wait(&cancelRequest, MPI_STATUS_IGNORE);
+      cancelled = cancel != 0;
+
+      // The variance estimate is only meaningful from the second frame on
+      // (it is reported as inf before that), and only rank 0 is guaranteed
+      // to see the composited value, so it decides for everyone.
+      float variance = ospGetVariance(session.frameBuffer);
+      double elapsed = MPI_Wtime() - start;
+      int done = 0;
+      if (opt_target_error > 0.0f && variance <= opt_target_error) done = 1;
+      if (opt_time_budget > 0.0f && elapsed >= opt_time_budget) done = 1;
+      if (cancelled) done = 1;
+      controller->Broadcast(&done, 1, 0);
+
+      DEBUG_RANK0(<< "\rframe " << frame << ": variance " << variance << ", elapsed " << elapsed << "s");
+      if (done) {
+        break;
+      }
+    }
+  }
 
-  ospResetAccumulation(frameBuffer);
-  future = ospRenderFrame(frameBuffer, renderer, camera, world);
-  ospWait(future, OSP_TASK_FINISHED);
-  ospRelease(future);
-  future = nullptr;
+  PERF_END(renderSample, Render);
+  DEBUG_RANK0(<< "render: " << (MPI_Wtime() - renderStart) << "s (" << (session.local ? "cpu" : "mpiDistributed") << ", " << instances.size() << " instances on rank 0)");
 
   if (controller->Barrier(), opt_rank == 0) {
-    std::string filename = std::string("vtkOSPRay.") + std::to_string(opt_rank) + std::string(".ppm");
-    const void *fb = ospMapFrameBuffer(frameBuffer, OSP_FB_COLOR);
+    std::string filename = std::string("vtkOSPRay.") + (opt_batch.empty() ? std::to_string(opt_rank) : std::string("job") + std::to_string(jobi)) + std::string(".ppm");
+    const void *fb = ospMapFrameBuffer(session.frameBuffer, OSP_FB_COLOR);
     writePPM(filename.c_str(), opt_width, opt_height, static_cast<const uint32_t *>(fb));
-    ospUnmapFrameBuffer(fb, frameBuffer);
+    ospUnmapFrameBuffer(fb, session.frameBuffer);
   }
 
-  // MPI_Finalize();
+  ospRelease(world);
+  ospRelease(worldRegionData);
+  ospRelease(instanceData);
+  for (OSPInstance instance_ : instances) {
+    ospRelease(instance_);
+  }
+  ospRelease(group);
+  ospRelease(volumetricModel);
+  ospRelease(transferFunction);
+  ospRelease(transferFunctionOpacityData);
+  ospRelease(transferFunctionColorData);
+  ospRelease(volume);
+  ospRelease(geometricModel);
+  ospRelease(material);
+  ospRelease(geometry);
+  ospRelease(volumeIndexData);
+  ospRelease(volumeCellDataData);
+  ospRelease(volumeVertexPositionData);
+  ospRelease(volumeCellIndexData);
+  ospRelease(volumeCellTypeData);
+
+  if (mapped != nullptr) {
+    munmap(const_cast<Mandelbrot::ScalarU *>(mapped), mappedBytes);
+  }
 
 # endif
 
-  return 0;
+  DEBUG_RANK0(<< "job " << jobi << ": " << (MPI_Wtime() - jobStart) << "s");
+}
+
+
+//---
+
+int main(int argc, char **argv) {
+  int provided;
+  int success = MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+  if (success != MPI_SUCCESS) {
+    fprintf(stderr, "Error while initializing MPI\n");
+    return 1;
+  }
+
+  if (provided != MPI_THREAD_MULTIPLE) {
+    fprintf(stderr, "MPI provided the wrong level of thread support\n");
+    return 1;
+  }
+
+  double startupStart = MPI_Wtime();
+
+  using Controller = vtkMPIController;
+  vtkNew<Controller> worldController;
+  worldController->Initialize(&argc, &argv, /* initializedExternally= */1);
+  struct guard {
+    guard(Controller *c) { vtkMultiProcessController::SetGlobalController(c); };
+    // ~guard() { vtkMultiProcessController::GetGlobalController()->Finalize(); };
+  } guard(worldController);
+
+  // In batch mode with -batch-groups > 1, this is replaced by the
+  // controller of this rank's sub-communicator.
+  vtkSmartPointer<vtkMultiProcessController> controller = worldController.Get();
+
+  PERF_OPEN();
+
+  defaults(controller);
+  parse(argc, argv);
+
+  // The job file has one job per line, each a list of the same arguments
+  // accepted on the command line (e.g. "-zmin 2 -zmax 3 -nx 32 -camz 8").
+  // Blank lines and lines starting with '#' are ignored. Options that set
+  // up the session are only read from the command line, so they are
+  // dropped (with a warning) from job lines.
+  static const char *sessionOptions[] = {
+    "-batch", "-batch-groups", "-hybrid", "-threads", "-cache-dir", "-cache-mem",
+  };
+
+  std::vector<std::vector<std::string>> jobs;
+  if (opt_batch.empty()) {
+    jobs.emplace_back();
+
+  } else {
+    std::ifstream stream(opt_batch);
+    if (!stream) {
+      fprintf(stderr, "Could not open batch file: %s\n", opt_batch.c_str());
+      return 1;
+    }
+
+    std::string line;
+    for (size_t lineno=1; std::getline(stream, line); ++lineno) {
+      std::istringstream tokens(line);
+      std::vector<std::string> job{"job"};
+      for (std::string token; tokens >> token; ) {
+        bool session = std::any_of(std::begin(sessionOptions), std::end(sessionOptions), [&](const char *option) { return token == option; });
+        if (session && (job.size() == 1 || job[1][0] != '#')) {
+          if (worldController->GetLocalProcessId() == 0) {
+            fprintf(stderr, "Warning: %s:%zu: %s only applies on the command line and is ignored\n", opt_batch.c_str(), lineno, token.c_str());
+          }
+          tokens >> token;
+          continue;
+        }
+
+        job.push_back(token);
+      }
+
+      if (job.size() == 1 || job[1][0] == '#') {
+        continue;
+      }
+
+      jobs.emplace_back(std::move(job));
+    }
+  }
+
+  // Kept apart from opt_batch_groups, which is reset by every job's parse.
+  size_t batch_groups = std::min(std::max<size_t>(1, opt_batch_groups), (size_t)worldController->GetNumberOfProcesses());
+  size_t batch_group = 0;
+  if (batch_groups > 1) {
+    batch_group = worldController->GetLocalProcessId() * batch_groups / worldController->GetNumberOfProcesses();
+    controller = vtkSmartPointer<vtkMultiProcessController>::Take(
+      worldController->PartitionController(batch_group, worldController->GetLocalProcessId()));
+    vtkMultiProcessController::SetGlobalController(controller);
+  }
+
+  // -cache-mem is in MiB.
+  Session session(opt_cache_dir, opt_cache_mem << 20);
+
+  // Hybrid mode expects one rank per node: each rank renders all of its
+  // blocks as separate instances using every local thread, and the
+  // mpiDistributed device is only needed when there is more than one rank.
+  session.local = opt_hybrid && controller->GetNumberOfProcesses() == 1;
+  if (opt_hybrid) {
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm);
+    int nodeSize;
+    MPI_Comm_size(nodeComm, &nodeSize);
+    MPI_Comm_free(&nodeComm);
+
+    if (nodeSize > 1 && worldController->GetLocalProcessId() == 0) {
+      fprintf(stderr, "Warning: -hybrid with %d ranks on one node; use one rank per node\n", nodeSize);
+    }
+  }
+
+  if (!session.local) {
+    ospLoadModule("mpi");
+  }
+
+  session.device = ospNewDevice(session.local ? "cpu" : "mpiDistributed");
+  if (opt_threads > 0) {
+    ospDeviceSetParam(session.device, "numThreads", OSP_INT, &opt_threads);
+  }
+  if (!session.local && batch_groups > 1) {
+    using Communicator = vtkMPICommunicator;
+    Communicator *communicator = Communicator::SafeDownCast(controller->GetCommunicator());
+    void *comm = communicator->GetMPIComm()->GetHandle();
+    ospDeviceSetParam(session.device, "worldCommunicator", OSP_VOID_PTR, &comm);
+  }
+  ospDeviceCommit(session.device);
+  ospSetCurrentDevice(session.device);
+
+  session.light = ospNewLight("ambient");
+  ospCommit(session.light);
+
+  session.camera = ospNewCamera("perspective");
+
+  session.renderer = ospNewRenderer(session.local ? "scivis" : "mpiRaycast");
+
+  double startupTime = MPI_Wtime() - startupStart;
+  double batchStart = MPI_Wtime();
+
+  for (size_t jobi=0; jobi<jobs.size(); ++jobi) {
+    if (jobi % batch_groups != batch_group) {
+      continue;
+    }
+
+    std::vector<char *> jobargv;
+    for (std::string &token : jobs[jobi]) {
+      jobargv.push_back(token.data());
+    }
+
+    defaults(controller);
+    parse(argc, argv);
+    parse((int)jobargv.size(), jobargv.data());
+
+    runJob(jobi, controller, session);
+  }
+
+  session.cache.flush();
+
+  double cacheStats[4] = { (double)session.cache.hits, (double)session.cache.resumes, (double)session.cache.misses, session.cache.saved };
+  double cacheTotals[4] = { 0.0, 0.0, 0.0, 0.0 };
+  worldController->Reduce(cacheStats, cacheTotals, 4, vtkCommunicator::SUM_OP, 0);
+
+  // The options left over from this rank's last job say nothing about the
+  // others, so anything after the loop goes by what the session recorded.
+  int cacheUsed = session.cacheUsed ? 1 : 0;
+  int anyCacheUsed = 0;
+  worldController->Reduce(&cacheUsed, &anyCacheUsed, 1, vtkCommunicator::MAX_OP, 0);
+
+  worldController->Barrier();
+  if (worldController->GetLocalProcessId() == 0) {
+    double batchTime = MPI_Wtime() - batchStart;
+    fprintf(stderr, "%zu jobs in %.3fs (%.1f jobs/hour), startup %.3fs\n",
+            jobs.size(), batchTime, 3600.0 * jobs.size() / batchTime, startupTime);
+
+    if (anyCacheUsed) {
+      double lookups = cacheTotals[0] + cacheTotals[1] + cacheTotals[2];
+      fprintf(stderr, "cache: %.0f hits, %.0f resumed, %.0f misses (hit ratio %.1f%%), %.3fs of compute saved (estimated)\n",
+              cacheTotals[0], cacheTotals[1], cacheTotals[2],
+              lookups > 0.0 ? 100.0 * (cacheTotals[0] + cacheTotals[1]) / lookups : 0.0,
+              cacheTotals[3]);
+    }
+  }
+
+  PERF_REPORT(worldController);
+
+  // MPI_Finalize();
+
+  return session.validateProblems == 0 ? 0 : 1;
 }